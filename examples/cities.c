@@ -39,7 +39,7 @@ int main(int argc, char **argv)
 
   city *query;
   int k = 5;
-  double dist, query_dist = 1000;
+  double *dists, query_dist = 1000;
 
   srand(time(NULL));
 
@@ -69,7 +69,8 @@ int main(int argc, char **argv)
 
   // Do a nearest neighbor query
   query = &cities[rand() % num_cities];
-  vptree_nearest_neighbor(vp, query, k+1, ptrs);
+  dists = (double *)malloc(sizeof(double) * (k+1));
+  vptree_nearest_neighbor_dist(vp, query, k+1, ptrs, dists);
   
   printf("%d nearest neighbors of %s:\n", k, query->name);
   for(i = 0; i < k+1; ++i) {
@@ -77,13 +78,13 @@ int main(int argc, char **argv)
       continue;
     }
 
-    dist = great_circle_distance(NULL, query, ptrs[i]);
-    printf("  %s (%.1fkm)\n", ((city *)ptrs[i])->name, dist);
+    printf("  %s (%.1fkm)\n", ((city *)ptrs[i])->name, dists[i]);
   }
+  free(dists);
 
   // Do an eps-neighborhood query
   query = &cities[rand() % num_cities];
-  nbrs = vptree_neighborhood(vp, query, query_dist, &k);
+  nbrs = vptree_neighborhood_dist(vp, query, query_dist, &k, &dists);
 
   printf("Cities within %.0fkm of %s:\n", query_dist, query->name); 
   for(i = 0; i < k; ++i) {
@@ -91,11 +92,11 @@ int main(int argc, char **argv)
       continue;
     }
 
-    dist = great_circle_distance(NULL, query, nbrs[i]);
-    printf("  %s (%.1fkm)\n", ((city *)nbrs[i])->name, dist);
+    printf("  %s (%.1fkm)\n", ((city *)nbrs[i])->name, dists[i]);
   }
 
   free(nbrs);
+  free(dists);
   free(ptrs);
 
   vptree_destroy(vp);
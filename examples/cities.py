@@ -80,6 +80,9 @@ class CityVPTree(pyvptree.VPTree):
 
         return dist
 
+    def distance_many(self, c, cities):
+        return [self.distance(c, c2) for c2 in cities]
+
 def main(argv):
     # Parse cities
     if len(argv) <= 1:
@@ -96,22 +99,22 @@ def main(argv):
     # Nearest neighbor query
     k = 5
     query = random.choice(cities)
-    nbrs = vp.nearest_neighbors(query, k+1)
-    nbrs.remove(query)
+    nbrs, dists = vp.nearest_neighbors(query, k+1, return_distances=True)
 
     print('%d nearest neighbors of %s:' % (k, query.name))
-    for nbr in nbrs:
-        print('  %s (%.1fkm)' % (nbr.name, vp.distance(query, nbr)))
+    for nbr, dist in zip(nbrs, dists):
+        if nbr is not query:
+            print('  %s (%.1fkm)' % (nbr.name, dist))
 
     # Neighborhood query
     distance = 1000.0
     query = random.choice(cities)
-    nbrs = vp.neighborhood(query, distance)
-    nbrs.remove(query)
+    nbrs, dists = vp.neighborhood(query, distance, return_distances=True)
 
     print('Cities within %.0fkm of %s:' % (distance, query.name))
-    for nbr in nbrs:
-        print('  %s (%.1fkm)' % (nbr.name, vp.distance(query, nbr)))
+    for nbr, dist in zip(nbrs, dists):
+        if nbr is not query:
+            print('  %s (%.1fkm)' % (nbr.name, dist))
     
 
 if __name__ == '__main__':
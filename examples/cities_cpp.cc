@@ -92,7 +92,8 @@ int main(int argc, char **argv)
   {
     const City &query = cities[rand() % num_cities];
     int k = 5;
-    vector<const City *> nbrs = vp.nearestNeighbors(query, k+1);
+    vector<double> distances;
+    vector<const City *> nbrs = vp.nearestNeighbors(query, k+1, distances);
 
     cout<<k<<" nearest neighbors of "<<query.name()<<":"<<endl;
     for(int i = 0; i < k; ++i) {
@@ -100,8 +101,7 @@ int main(int argc, char **argv)
 	continue;
       }
     
-      double distance = vp.distance(query, *(nbrs[i]));
-      cout<<"  "<<nbrs[i]->name()<<" ("<<distance<<"km"<<')'<<endl;
+      cout<<"  "<<nbrs[i]->name()<<" ("<<distances[i]<<"km"<<')'<<endl;
     }
   }
 
@@ -109,7 +109,8 @@ int main(int argc, char **argv)
   {
     const City &query = cities[rand() % num_cities];
     double distance = 1000.0;
-    vector<const City *> nbrs = vp.neighborhood(query, distance);
+    vector<double> distances;
+    vector<const City *> nbrs = vp.neighborhood(query, distance, distances);
 
     cout<<"Cities within ";
     cout<<setprecision(0)<<distance<<setprecision(1);
@@ -119,8 +120,7 @@ int main(int argc, char **argv)
 	continue;
       }
 
-      distance = vp.distance(query, *(nbrs[i]));
-      cout<<"  "<<nbrs[i]->name()<<" ("<<distance<<"km"<<')'<<endl;
+      cout<<"  "<<nbrs[i]->name()<<" ("<<distances[i]<<"km"<<')'<<endl;
     }
   }
 
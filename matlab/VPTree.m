@@ -31,24 +31,25 @@ classdef VPTree < handle
             vptree_mex('add', obj.vp, pt);
         end
         
-        function nbrs = nearest_neighbor(obj, query, k)
-            % nbrs = obj.nearest_neighbor(query, k)
+        function [nbrs, dists] = nearest_neighbor(obj, query, k)
+            % [nbrs, dists] = obj.nearest_neighbor(query, k)
             %
-            %   Perform a k-nearest neighbor query.
+            %   Perform a k-nearest neighbor query.  Optionally also
+            %   returns the distances to the neighbors.
             %
             % query: The query point.
             %     k: The number of neighbors to return.
             
-            nbrs = vptree_mex('nearest_neighbor', obj.vp, query, k);
+            [nbrs, dists] = vptree_mex('nearest_neighbor', obj.vp, query, k);
         end
         
-        function nbrs = nearest_neighbor_approx(obj, query, k, max_nodes)
-            % nbrs = obj.nearest_neighbor_approx(query, k, max_nodes)
+        function [nbrs, dists] = nearest_neighbor_approx(obj, query, k, max_nodes)
+            % [nbrs, dists] = obj.nearest_neighbor_approx(query, k, max_nodes)
             %
             %   Perform an approximate k-nearest neighbor query.
             %   Visits a limited number of nodes in a priority
             %   order, and returns the best k neighbors found in
-            %   this limited search.
+            %   this limited search, optionally with their distances.
             %
             %
             %     query: The query point.
@@ -56,35 +57,42 @@ classdef VPTree < handle
             % max_nodes: The maximum number of nodes to visit in
             %            the search.
             
-            nbrs = vptree_mex('nearest_neighbor_approx', obj.vp, ...
-                              query, k, max_nodes);
+            [nbrs, dists] = vptree_mex('nearest_neighbor_approx', obj.vp, ...
+                                       query, k, max_nodes);
         end
         
-        function nbrs = neighborhood(obj, query, max_dist)
-            % nbrs = obj.neighborhood(query, max_dist)
+        function [nbrs, dists] = neighborhood(obj, query, max_dist)
+            % [nbrs, dists] = obj.neighborhood(query, max_dist)
             %
             %   Perform an epsilon-neighbor search.  Finds all
             %   points in the VP-tree (strictly) within max_dist of the query
-            %   point.
+            %   point, optionally with their distances.
             %
             %     query: The query point.
             %  max_dist: Returns all neighbors within this distance
             %            from the query.
                 
-            nbrs = vptree_mex('neighborhood', obj.vp, query, max_dist);
+            [nbrs, dists] = vptree_mex('neighborhood', obj.vp, query, max_dist);
         end
         
-        function incnn = incremental_neighbors(obj, query)
-           % incnn = obj.incremental_neighbors(query)
+        function incnn = incremental_neighbors(obj, query, max_dist)
+           % incnn = obj.incremental_neighbors(query, max_dist)
            %
            %   Performs an incremental nearest neighbor search on
-           %   query.  Returns a object 'incnn' with method 'next'.
-           %   Repeated calls to the 'next' method will return the
+           %   query.  Returns a object 'incnn' with methods 'next'
+           %   and 'next_many'.  Repeated calls will return the
            %   points in the VP-tree in order of increasing
            %   distance from query.  This can return an arbitrary
            %   number of such neighbors.
+           %
+           %  max_dist: Optional, end the search before the first
+           %            neighbor at this distance or more.
                
-           incnn = VPTreeIncNN(obj.vp, query);
+           if nargin < 3
+               incnn = VPTreeIncNN(obj.vp, query);
+           else
+               incnn = VPTreeIncNN(obj.vp, query, max_dist);
+           end
         end
     end
 end
@@ -2,16 +2,65 @@ classdef VPTreeIncNN < handle
     properties (Access = private)
         vp
         incnn
+
+        % Neighbors fetched ahead, in batches that double up to 256
+        nbrs = {}
+        dists = []
+        pos = 1
+        batch = 4
     end
     
     methods
-        function obj = VPTreeIncNN(vp, query)
+        function obj = VPTreeIncNN(vp, query, max_dist)
             obj.vp = vp;
-            obj.incnn = vptree_mex('incnn_begin', vp, query);
+            if nargin < 3
+                obj.incnn = vptree_mex('incnn_begin', vp, query);
+            else
+                obj.incnn = vptree_mex('incnn_begin', vp, query, max_dist);
+            end
         end
         
-        function nbr = next(obj)
-            nbr = vptree_mex('incnn_next', obj.vp, obj.incnn);
+        function [nbr, dist] = next(obj)
+            % [nbr, dist] = obj.next()
+            %
+            %   The next nearest neighbor and its distance, or [] and Inf
+            %   once there are no more.
+
+            if obj.pos > numel(obj.nbrs)
+                obj.batch = min(2 * obj.batch, 256);
+                [obj.nbrs, obj.dists] = vptree_mex('incnn_next_many', ...
+                                                   obj.vp, obj.incnn, obj.batch);
+                obj.pos = 1;
+            end
+            if obj.pos > numel(obj.nbrs)
+                nbr = [];
+                dist = Inf;
+                return;
+            end
+            nbr = obj.nbrs{obj.pos};
+            dist = obj.dists(obj.pos);
+            obj.pos = obj.pos + 1;
+        end
+
+        function [nbrs, dists] = next_many(obj, m)
+            % [nbrs, dists] = obj.next_many(m)
+            %
+            %   Up to m more neighbors, in a cell array, and their
+            %   distances.  Fewer than m once there are no more.
+
+            nbrs = obj.nbrs(obj.pos:end);
+            dists = obj.dists(obj.pos:end);
+            obj.pos = numel(obj.nbrs) + 1;
+            if numel(nbrs) > m
+                obj.pos = obj.pos - (numel(nbrs) - m);
+                nbrs = nbrs(1:m);
+                dists = dists(1:m);
+            elseif numel(nbrs) < m
+                [more, more_dists] = vptree_mex('incnn_next_many', obj.vp, ...
+                                                obj.incnn, m - numel(nbrs));
+                nbrs = [nbrs; more];
+                dists = [dists; more_dists];
+            end
         end
         
         function delete(obj)
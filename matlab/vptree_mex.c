@@ -47,6 +47,7 @@ static void vpmex_update_tree(vpmex_tree *mexvp);
 static void vpmex_append_elt(vpmex_tree *mexvp, const mxArray *arr);
 
 static mxArray *vpmex_neighbors_to_cellarr(int n, const void **nn);
+static mxArray *vpmex_distances_to_arr(int n, const double *dist);
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
@@ -56,6 +57,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   char *cmd = mxArrayToString(prhs[0]);
   const mxArray *query, *distance_handle;
   const void **nn;
+  double *dist;
   int k, max_nodes;
   double eps;
 
@@ -94,9 +96,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     }
 
     nn = (const void **)mxMalloc(sizeof(const void *) * k);
-    vptree_nearest_neighbor(mexvp->vp, query, k, nn);
+    dist = (double *)mxMalloc(sizeof(double) * k);
+    vptree_nearest_neighbor_dist(mexvp->vp, query, k, nn, dist);
     plhs[0] = vpmex_neighbors_to_cellarr(k, nn);
+    if(nlhs > 1) {
+      plhs[1] = vpmex_distances_to_arr(k, dist);
+    }
     mxFree(nn);
+    mxFree(dist);
   }
   else if(!strcmp(cmd, "nearest_neighbor_approx")) {
     mex_assert(nrhs == 5);
@@ -112,9 +119,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     }
 
     nn = (const void **)mxMalloc(sizeof(const void *) * k);
-    vptree_nearest_neighbor_approx(mexvp->vp, query, k, nn, max_nodes);
+    dist = (double *)mxMalloc(sizeof(double) * k);
+    vptree_nearest_neighbor_approx_dist(mexvp->vp, query, k, nn, dist, max_nodes);
     plhs[0] = vpmex_neighbors_to_cellarr(k, nn);
+    if(nlhs > 1) {
+      plhs[1] = vpmex_distances_to_arr(k, dist);
+    }
     mxFree(nn);
+    mxFree(dist);
   }
   else if(!strcmp(cmd, "neighborhood")) {
     mex_assert(nrhs == 4);
@@ -125,13 +137,17 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
     
     vpmex_update_tree(mexvp);
-    nn = vptree_neighborhood(mexvp->vp, query, eps, &k);
+    nn = vptree_neighborhood_dist(mexvp->vp, query, eps, &k, &dist);
     plhs[0] = vpmex_neighbors_to_cellarr(k, nn);
+    if(nlhs > 1) {
+      plhs[1] = vpmex_distances_to_arr(k, dist);
+    }
 
     mxFree(nn);
+    mxFree(dist);
   }
   else if(!strcmp(cmd, "incnn_begin")) {
-    mex_assert(nrhs == 3);
+    mex_assert(nrhs == 3 || nrhs == 4);
     mexvp = vpmex_from_handle(prhs[1]);
     query = prhs[2];
 
@@ -141,6 +157,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
     incnn->incnn = vptree_incnn_begin(mexvp->vp, incnn->query);
     mex_assert(incnn->incnn != NULL);
+    if(nrhs == 4) {
+      vptree_incnn_set_max_distance(incnn->incnn, mxArrayToDoubleScalar(prhs[3]));
+    }
 
     mexMakeArrayPersistent(incnn->query);
     mexMakeMemoryPersistent(incnn);
@@ -152,8 +171,29 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     mexvp = vpmex_from_handle(prhs[1]);
     incnn = vpmex_incnn_from_handle(prhs[2]);
 
-    incnbr = vptree_incnn_next(incnn->incnn);
+    eps = mxGetInf();
+    incnbr = vptree_incnn_next_dist(incnn->incnn, &eps);
     plhs[0] = mxDuplicateArray((const mxArray *)incnbr);
+    if(nlhs > 1) {
+      plhs[1] = mxCreateDoubleScalar(eps);
+    }
+  }
+  else if(!strcmp(cmd, "incnn_next_many")) {
+    mex_assert(nrhs == 4);
+    mexvp = vpmex_from_handle(prhs[1]);
+    incnn = vpmex_incnn_from_handle(prhs[2]);
+    k = mxArrayToIntScalar(prhs[3]);
+    mex_assert(k >= 0);
+
+    nn = (const void **)mxMalloc(sizeof(const void *) * (k + 1));
+    dist = (double *)mxMalloc(sizeof(double) * (k + 1));
+    k = vptree_incnn_next_many(incnn->incnn, k, nn, dist);
+    plhs[0] = vpmex_neighbors_to_cellarr(k, nn);
+    if(nlhs > 1) {
+      plhs[1] = vpmex_distances_to_arr(k, dist);
+    }
+    mxFree(nn);
+    mxFree(dist);
   }
   else if(!strcmp(cmd, "incnn_end")) {
     mex_assert(nrhs == 3);
@@ -369,3 +409,15 @@ static mxArray *vpmex_neighbors_to_cellarr(int n, const void **nn)
 
   return cellarr;
 }
+
+static mxArray *vpmex_distances_to_arr(int n, const double *dist)
+{
+  mxArray *arr;
+
+  arr = mxCreateDoubleMatrix((mwSize)n, 1, mxREAL);
+  if(n > 0) {
+    memcpy(mxGetPr(arr), dist, sizeof(double) * n);
+  }
+
+  return arr;
+}
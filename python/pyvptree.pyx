@@ -23,6 +23,20 @@ cdef double pydistance(void *user_data, const void *p1, const void *p2) noexcept
     self.excepts = sys.exc_info()[0]
     return -1
 
+cdef void pydistance_many(void *user_data, const void *q, int n, const void * const *p, double *out) noexcept:
+  self = <object>user_data
+  pyq = <object>q
+  points = [<object>p[i] for i in range(n)]
+
+  try:
+    dists = self.distance_many(pyq, points)
+    for i in range(n):
+      out[i] = dists[i]
+  except:
+    self.excepts = sys.exc_info()[0]
+    for i in range(n):
+      out[i] = -1
+
 cdef class VPTree:
   cdef vptree.vptree* _c_vp
 
@@ -33,6 +47,10 @@ cdef class VPTree:
     opts.allocate = pyalloc
     opts.deallocate = pyfree
     opts.reallocate = pyrealloc
+    # Subclasses may define distance_many(query, points), returning the
+    # distance from query to each point, to be called once per batch
+    if hasattr(self, 'distance_many'):
+      opts.distance_many = pydistance_many
     self._c_vp = vptree.vptree_create(cython.sizeof(opts), &opts)
     if self._c_vp is NULL:
       raise MemoryError()
@@ -72,56 +90,95 @@ cdef class VPTree:
     if self.excepts is not None:
       raise self.excepts
 
-  def nearest_neighbors(self, query, k = 1, max_nodes = None):
+  def nearest_neighbors(self, query, k = 1, max_nodes = None, return_distances = False):
     k = min(k, len(self.points))  # Truncate if too few possible neighbors
     if k < 0:
       raise ValueError(f"Invalid k = {k}")
     cdef const void **ptrs = <const void **>PyMem_Malloc(k * sizeof(void *))
+    cdef double *dists = <double *>PyMem_Malloc(k * sizeof(double))
 
     if max_nodes is None:
-      vptree.vptree_nearest_neighbor(self._c_vp, <const void *>query, k, ptrs)
+      vptree.vptree_nearest_neighbor_dist(self._c_vp, <const void *>query, k, ptrs, dists)
     else:
-      vptree.vptree_nearest_neighbor_approx(self._c_vp, <const void *>query, k, ptrs, max_nodes)
+      vptree.vptree_nearest_neighbor_approx_dist(self._c_vp, <const void *>query, k, ptrs, dists, max_nodes)
 
     if self.excepts is not None:
       PyMem_Free(ptrs)
+      PyMem_Free(dists)
       raise self.excepts
 
     nn = []
     for i in range(k):
       nn.append(<object>ptrs[i])
+    nndist = [dists[i] for i in range(k)]
 
     PyMem_Free(ptrs)
+    PyMem_Free(dists)
 
+    if return_distances:
+      return nn, nndist
     return nn
 
-  def neighborhood(self, query, distance):
+  def neighborhood(self, query, distance, return_distances = False):
     cdef const void **ptrs
+    cdef double *dists
     cdef int npoints
 
-    ptrs = vptree.vptree_neighborhood(self._c_vp, <const void *>query, distance, &npoints)
+    ptrs = vptree.vptree_neighborhood_dist(self._c_vp, <const void *>query, distance, &npoints, &dists)
 
     if self.excepts is not None:
       PyMem_Free(ptrs)
+      PyMem_Free(dists)
       raise self.excepts
 
     nn = []
     for i in range(npoints):
       nn.append(<object>ptrs[i])
+    nndist = [dists[i] for i in range(npoints)]
 
     PyMem_Free(ptrs)
+    PyMem_Free(dists)
 
+    if return_distances:
+      return nn, nndist
     return nn
 
-  def incremental_knn(self, query):
+  def incremental_knn(self, query, return_distances = False, max_distance = None):
     cdef vptree.vptree_incnn *incnn
-    cdef const void *next
+    cdef const void **ptrs
+    cdef double *dists
+    cdef int m = 8, n, i
 
     incnn = vptree.vptree_incnn_begin(self._c_vp, <const void *>query)
-
-    next = vptree.vptree_incnn_next(incnn)
-    while next is not NULL:
-      yield <object>next
-      next = vptree.vptree_incnn_next(incnn)
-      
-    vptree.vptree_incnn_end(incnn)
\ No newline at end of file
+    if incnn is NULL:
+      raise MemoryError()
+    if max_distance is not None:
+      vptree.vptree_incnn_set_max_distance(incnn, max_distance)
+
+    # Neighbors are fetched in batches that double up to 256, so that the
+    # search is entered once per batch rather than once per neighbor
+    ptrs = <const void **>PyMem_Malloc(256 * sizeof(void *))
+    dists = <double *>PyMem_Malloc(256 * sizeof(double))
+    try:
+      if ptrs is NULL or dists is NULL:
+        raise MemoryError()
+
+      while True:
+        n = vptree.vptree_incnn_next_many(incnn, m, ptrs, dists)
+        if self.excepts is not None:
+          raise self.excepts
+
+        batch = [(<object>ptrs[i], dists[i]) for i in range(n)]
+        for nbr, dist in batch:
+          if return_distances:
+            yield nbr, dist
+          else:
+            yield nbr
+
+        if n < m:
+          break
+        m = min(2 * m, 256)
+    finally:
+      PyMem_Free(ptrs)
+      PyMem_Free(dists)
+      vptree.vptree_incnn_end(incnn)
\ No newline at end of file
@@ -3,6 +3,7 @@ cdef extern from "../include/vptree/vptree.h":
   ctypedef void *(*alloc_funcptr)(void *, size_t)
   ctypedef void (*dealloc_funcptr)(void *, void *)
   ctypedef void *(*realloc_funcptr)(void *, void *, size_t)
+  ctypedef void (*distance_many_funcptr)(void *, const void *, int, const void * const *, double *)
 
   ctypedef struct vptree_options:
     void *user_data
@@ -10,6 +11,7 @@ cdef extern from "../include/vptree/vptree.h":
     alloc_funcptr allocate
     dealloc_funcptr deallocate
     realloc_funcptr reallocate
+    distance_many_funcptr distance_many
 
   vptree_options vptree_default_options
 
@@ -26,12 +28,18 @@ cdef extern from "../include/vptree/vptree.h":
 
   void vptree_nearest_neighbor(const vptree *vp, const void *p, int k, const void *nn)
   void vptree_nearest_neighbor_approx(const vptree *vp, const void *p, int k, const void *nn, int max_nodes)
+  void vptree_nearest_neighbor_dist(const vptree *vp, const void *p, int k, const void *nn, double *dist)
+  void vptree_nearest_neighbor_approx_dist(const vptree *vp, const void *p, int k, const void *nn, double *dist, int max_nodes)
 
   const void **vptree_neighborhood(const vptree *vp, const void *p, double distance, int *n)
+  const void **vptree_neighborhood_dist(const vptree *vp, const void *p, double distance, int *n, double **dist)
 
   ctypedef struct vptree_incnn:
     pass
 
   vptree_incnn *vptree_incnn_begin(const vptree *vp, const void *p)
   const void *vptree_incnn_next(vptree_incnn *inc)
+  const void *vptree_incnn_next_dist(vptree_incnn *inc, double *dist)
+  int vptree_incnn_next_many(vptree_incnn *inc, int m, const void **nn, double *dist)
+  void vptree_incnn_set_max_distance(vptree_incnn *inc, double max_dist)
   void vptree_incnn_end(vptree_incnn *)
\ No newline at end of file
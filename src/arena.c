@@ -0,0 +1,101 @@
+#include "arena.h"
+
+/**
+ * Alignment of every allocation, and size of each slab's link header
+ */
+#define ARENA_ALIGN (16)
+
+static size_t align_up(size_t s)
+{
+  return (s + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arena_init(arena_t *a, size_t slab_size,
+                arena_allocate_f alloc, arena_deallocate_f dealloc,
+                void *user_data)
+{
+  a->slab_size = slab_size;
+  a->slabs = NULL;
+  a->next = a->end = NULL;
+  a->alloc = alloc;
+  a->dealloc = dealloc;
+  a->user_data = user_data;
+}
+
+void arena_destroy(arena_t *a)
+{
+  void *slab, *next;
+
+  for(slab = a->slabs; slab != NULL; slab = next) {
+    next = *(void **)slab;
+    a->dealloc(a->user_data, slab);
+  }
+
+  a->slabs = NULL;
+  a->next = a->end = NULL;
+}
+
+void *arena_alloc(arena_t *a, size_t s)
+{
+  size_t slab_size;
+  char *slab;
+  void *obj;
+
+  s = align_up(s);
+
+  if(a->next == NULL || (size_t)(a->end - a->next) < s) {
+    slab_size = ARENA_ALIGN + s;
+    if(slab_size < a->slab_size) {
+      slab_size = a->slab_size;
+    }
+
+    slab = (char *)a->alloc(a->user_data, slab_size);
+    if(slab == NULL) {
+      return NULL;
+    }
+
+    *(void **)slab = a->slabs;
+    a->slabs = slab;
+    a->next = slab + ARENA_ALIGN;
+    a->end = slab + slab_size;
+  }
+
+  obj = a->next;
+  a->next += s;
+
+  return obj;
+}
+
+void arena_pool_init(arena_pool_t *pool, size_t size)
+{
+  // Free objects hold the free list link
+  if(size < sizeof(void *)) {
+    size = sizeof(void *);
+  }
+
+  pool->size = size;
+  pool->free = NULL;
+}
+
+void *arena_pool_alloc(arena_t *a, arena_pool_t *pool)
+{
+  void *obj;
+
+  if(pool->free != NULL) {
+    obj = pool->free;
+    pool->free = *(void **)obj;
+    return obj;
+  }
+
+  return arena_alloc(a, pool->size);
+}
+
+void arena_pool_free(arena_pool_t *pool, void *obj)
+{
+  if(obj == NULL) {
+    return;
+  }
+
+  *(void **)obj = pool->free;
+  pool->free = obj;
+}
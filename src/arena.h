@@ -0,0 +1,83 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdlib.h>
+
+/** For using in custom allocators */
+typedef void *(*arena_allocate_f)(void *user_data, size_t s);
+typedef void (*arena_deallocate_f)(void *user_data, void *data);
+
+/**
+ * Bump allocator carving objects out of large slabs.
+ *
+ * Objects are not freed individually; all slabs are released together by
+ * arena_destroy.  Fixed-size objects that are discarded early can be
+ * recycled through an arena_pool.
+ */
+typedef struct arena_t
+{
+  size_t slab_size;
+
+  /**
+   * Allocated slabs, linked through their first word
+   */
+  void *slabs;
+
+  /**
+   * Unused space in the newest slab
+   */
+  char *next, *end;
+
+  arena_allocate_f alloc;
+  arena_deallocate_f dealloc;
+  void *user_data;  // Passed to allocator
+} arena_t;
+
+/**
+ * Free list of objects of one size, allocated from an arena
+ */
+typedef struct arena_pool_t
+{
+  size_t size;
+  void *free;
+} arena_pool_t;
+
+/**
+ * Initialize an empty arena
+ *
+ * @param slab_size The size in bytes of each slab requested from @c alloc.
+ *                  Larger objects get a slab of their own.
+ */
+void arena_init(arena_t *a, size_t slab_size,
+                arena_allocate_f alloc, arena_deallocate_f dealloc,
+                void *user_data);
+
+/**
+ * Release every slab, and with them every object allocated from the arena.
+ * The arena may be reused afterwards.
+ */
+void arena_destroy(arena_t *a);
+
+/**
+ * Allocate @c s bytes, aligned for any of the library's types.
+ *
+ * @return NULL for insufficent memory
+ */
+void *arena_alloc(arena_t *a, size_t s);
+
+/**
+ * Initialize an empty pool of objects of @c size bytes
+ */
+void arena_pool_init(arena_pool_t *pool, size_t size);
+
+/**
+ * Allocate an object, reusing one returned to the pool if possible
+ */
+void *arena_pool_alloc(arena_t *a, arena_pool_t *pool);
+
+/**
+ * Return an object to the pool for reuse
+ */
+void arena_pool_free(arena_pool_t *pool, void *obj);
+
+#endif // #ifndef __ARENA_H__
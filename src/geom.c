@@ -35,6 +35,28 @@ double geom_l2distance(size_t ndims, const double *p, const double *q)
   return dist;
 }
 
+double geom_l2distance_bounded(size_t ndims, const double *p, const double *q,
+                               double bound)
+{
+  size_t i, j, end;
+  double dist, diff, limit;
+
+  // Compare against the bound every 8 dimensions, so that the inner loop
+  // stays branch-free
+  limit = bound * bound;
+  dist = 0;
+  for(i = 0; i < ndims && dist <= limit; i = end) {
+    end = (i + 8 < ndims) ? i + 8 : ndims;
+    for(j = i; j < end; j++) {
+      diff = p[j] - q[j];
+      dist += diff * diff;
+    }
+  }
+  dist = sqrt(dist);
+
+  return dist;
+}
+
 double geom_linftydistance(size_t ndims, const double *p, const double *q)
 {
   size_t i;
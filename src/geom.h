@@ -12,6 +12,13 @@ double geom_l2distance(size_t ndims, const double *p, const double *q);
 double geom_linftydistance(size_t ndims, const double *p, const double *q);
 double geom_lpdistance(double p, size_t ndims, const double *q, const double *r);
 
+/**
+ * L2 distance, abandoned once it exceeds @c bound.  Exact if it is at most
+ * @c bound, otherwise some value above @c bound.
+ */
+double geom_l2distance_bounded(size_t ndims, const double *p, const double *q,
+                               double bound);
+
 #define geom_distance geom_l2distance
 
 ////////////////////////////// Norms //////////////////////////
@@ -81,6 +81,13 @@ pqueue_free(pqueue_t *q)
 }
 
 
+void
+pqueue_clear(pqueue_t *q)
+{
+    q->size = 1;
+}
+
+
 size_t
 pqueue_size(pqueue_t *q)
 {
@@ -99,6 +99,13 @@ pqueue_init(size_t n,
 void pqueue_free(pqueue_t *q);
 
 
+/**
+ * remove all items from the queue, keeping its storage.
+ * @param q the queue
+ */
+void pqueue_clear(pqueue_t *q);
+
+
 /**
  * return the size of the queue.
  * @param q the queue
@@ -16,6 +16,8 @@ static const void *ptr[N];
 static double frand(unsigned *seed, double a, double b);
 static void frandvec(unsigned *seed, int n, double *p, double a, double b);
 static double distance(void *user_data, const void *p1, const void *p2);
+static double distance_bounded(void *user_data, const void *p1, const void *p2,
+                               double bound);
 static double exhaustive_search(const double *query);
 static double avg_distance(const double *query);
 static int numcloser(const double *query, int i);
@@ -57,6 +59,7 @@ int main(int argc, char **argv)
   vpopts = vptree_default_options;
   vpopts.user_data = NULL;
   vpopts.distance = distance;
+  vpopts.distance_bounded = distance_bounded;
 
   vp = vptree_create(sizeof(vpopts), &vpopts);
   vptree_add_many(vp, N, ptr);
@@ -75,17 +78,14 @@ int main(int argc, char **argv)
 
     // VP-tree search
     timer_start(&timer);
-    vptree_nearest_neighbor(vp, (const void *)q, 1, &nn);
+    vptree_nearest_neighbor_dist(vp, (const void *)q, 1, &nn, &vptree_distance[t]);
     vptree_time += timer_interval(&timer);
 
-    vptree_distance[t] = geom_distance(DIM, q, (const double *)nn);
-
     // Approximate VP-tree search
     timer_start(&timer);
-    vptree_nearest_neighbor_approx(vp, (const void *)q, 1, &nn, MAX_NODES);
+    vptree_nearest_neighbor_approx_dist(vp, (const void *)q, 1, &nn, &approx_distance[t], MAX_NODES);
     approx_time += timer_interval(&timer);
     
-    approx_distance[t] = geom_distance(DIM, q, (const double *)nn);
     ncloser[t] = numcloser(q, ((double *)nn - points)/DIM);
   }
 
@@ -173,6 +173,12 @@ static double distance(void *user_data, const void *p1, const void *p2)
   return geom_distance(DIM, (const double *)p1, (const double *)p2);
 }
 
+static double distance_bounded(void *user_data, const void *p1, const void *p2,
+                               double bound)
+{
+  return geom_l2distance_bounded(DIM, (const double *)p1, (const double *)p2, bound);
+}
+
 static double exhaustive_search(const double *query)
 {
   int i;
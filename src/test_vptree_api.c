@@ -0,0 +1,760 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#include "vptree.h"
+#include "geom.h"
+
+#define N (2000)
+#define DIM (6)
+#define TRIALS (24)
+#define K (10)
+#define MAX_K (200)
+#define PARALLEL_N (12288)
+#define THREADS (4)
+
+static double points[N * DIM];
+static const void *ptr[N];
+static int nfailed;
+
+typedef struct {
+  const char *name;
+  int leaf_size, arity, pivot_history, slab_size;
+  int bounded, many;
+  vptree_vantage vantage;
+} config;
+
+static const config configs[] = {
+  {"default",     1, 2, 0,  0, 0, 0, VPTREE_VANTAGE_RANDOM},
+  {"leaf",        8, 2, 0,  0, 0, 0, VPTREE_VANTAGE_RANDOM},
+  {"arity",       1, 4, 0,  0, 0, 0, VPTREE_VANTAGE_RANDOM},
+  {"pivot",       1, 2, 4,  0, 1, 0, VPTREE_VANTAGE_RANDOM},
+  {"slab",        1, 2, 0, 64, 0, 1, VPTREE_VANTAGE_RANDOM},
+  {"spread",      4, 2, 0,  0, 0, 0, VPTREE_VANTAGE_SPREAD},
+  {"farthest",    1, 3, 2,  0, 0, 0, VPTREE_VANTAGE_FARTHEST},
+  {"combined",    4, 3, 3, 32, 1, 1, VPTREE_VANTAGE_RANDOM}
+};
+
+typedef struct {
+  const double *q;
+  int n, stop, bad;
+} visit_state;
+
+typedef struct {
+  int i, n, bad;
+} progress_state;
+
+static double frand(unsigned *seed, double a, double b);
+static void frandvec(unsigned *seed, int n, double *p, double a, double b);
+static double distance(void *user_data, const void *p1, const void *p2);
+static double distance_bounded(void *user_data, const void *p1, const void *p2,
+                               double bound);
+static void distance_many(void *user_data, const void *q, int n,
+                          const void * const *p, double *dist);
+static double line_distance(void *user_data, const void *p1, const void *p2);
+static int visit(void *user_data, const void *p, double d);
+static void progress(void *user_data, int i, int n);
+static int compare_doubles(const void *a, const void *b);
+static double *exhaustive_distances(const double *q, const int *alive);
+static int exhaustive_count(const double *ref, int n, double r);
+static void check_tree(vptree *vp, const int *alive, int nalive, const char *tag);
+static void check_config(const config *c);
+static void check_ties(void);
+static void check_sorted(void);
+static void check_progress(void);
+static void check_parallel(void);
+
+#define CHECK(cond, tag, what) \
+  do { \
+    if(!(cond)) { \
+      nfailed++; \
+      if(nfailed <= 20) { \
+        fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, tag, what); \
+      } \
+    } \
+  } while(0)
+
+#define SAME(a, b) (fabs((a) - (b)) < 1e-12)
+
+int main(int argc, char **argv)
+{
+  int i;
+  unsigned seed;
+
+  // Create points, with the last tenth duplicating the first
+  seed = 1;
+  frandvec(&seed, N * DIM, points, 0, 1);
+  memcpy(points + DIM * (N - N/10), points, sizeof(double) * DIM * (N/10));
+  for(i = 0; i < N; i++) {
+    ptr[i] = points + DIM * i;
+  }
+
+  for(i = 0; i < (int)(sizeof(configs) / sizeof(configs[0])); i++) {
+    check_config(&configs[i]);
+  }
+  check_ties();
+  check_sorted();
+  check_progress();
+  check_parallel();
+
+  if(nfailed) {
+    printf("%d checks failed\n", nfailed);
+    return 1;
+  }
+  printf("All checks passed\n");
+
+  return 0;
+}
+
+static void check_config(const config *c)
+{
+  int i, j, nalive, frozen;
+  int alive[N];
+  unsigned seed;
+  char tag[64];
+  vptree_options vpopts;
+  vptree *vp, *cl;
+
+  vpopts = vptree_default_options;
+  vpopts.distance = distance;
+  vpopts.leaf_size = c->leaf_size;
+  vpopts.arity = c->arity;
+  vpopts.pivot_history = c->pivot_history;
+  vpopts.slab_size = c->slab_size;
+  vpopts.vantage = c->vantage;
+  if(c->bounded) {
+    vpopts.distance_bounded = distance_bounded;
+  }
+  if(c->many) {
+    vpopts.distance_many = distance_many;
+  }
+
+  // Bulk construction, its clone, and the frozen layout of both
+  vp = vptree_create(sizeof(vpopts), &vpopts);
+  vptree_add_many(vp, N, ptr);
+  snprintf(tag, sizeof(tag), "%s/bulk", c->name);
+  CHECK(vptree_npoints(vp) == N, tag, "npoints");
+  check_tree(vp, NULL, N, tag);
+
+  cl = vptree_clone(vp);
+  snprintf(tag, sizeof(tag), "%s/clone", c->name);
+  check_tree(cl, NULL, N, tag);
+  vptree_destroy(cl);
+
+  snprintf(tag, sizeof(tag), "%s/frozen", c->name);
+  CHECK(vptree_freeze(vp) == 0, tag, "freeze");
+  CHECK(vptree_add(vp, ptr[0]) != 0, tag, "add to a frozen tree");
+  check_tree(vp, NULL, N, tag);
+
+  cl = vptree_clone(vp);
+  snprintf(tag, sizeof(tag), "%s/frozen-clone", c->name);
+  check_tree(cl, NULL, N, tag);
+  vptree_destroy(cl);
+  vptree_destroy(vp);
+
+  // Incremental construction
+  vp = vptree_create(sizeof(vpopts), &vpopts);
+  for(i = 0; i < N; i++) {
+    vptree_add(vp, ptr[i]);
+  }
+  snprintf(tag, sizeof(tag), "%s/single", c->name);
+  check_tree(vp, NULL, N, tag);
+  vptree_destroy(vp);
+
+  // Removal from a dynamic and from a frozen tree
+  for(frozen = 0; frozen < 2; frozen++) {
+    vp = vptree_create(sizeof(vpopts), &vpopts);
+    vptree_add_many(vp, N, ptr);
+    if(frozen) {
+      vptree_freeze(vp);
+    }
+
+    for(i = 0; i < N; i++) {
+      alive[i] = 1;
+    }
+    nalive = N;
+
+    snprintf(tag, sizeof(tag), "%s/%s", c->name, frozen ? "frozen-removed" : "removed");
+    seed = 99;
+    for(i = 0; i < 2*N/3; i++) {
+      j = rand_r(&seed) % N;
+      CHECK((vptree_remove(vp, ptr[j]) == 0) == (alive[j] != 0), tag, "remove");
+      if(alive[j]) {
+        alive[j] = 0;
+        nalive--;
+      }
+    }
+    CHECK(vptree_npoints(vp) == nalive, tag, "npoints");
+    check_tree(vp, alive, nalive, tag);
+
+    if(!frozen) {
+      snprintf(tag, sizeof(tag), "%s/compacted", c->name);
+      CHECK(vptree_compact(vp, 0) == 0, tag, "compact");
+      CHECK(vptree_npoints(vp) == nalive, tag, "npoints");
+      check_tree(vp, alive, nalive, tag);
+
+      snprintf(tag, sizeof(tag), "%s/readded", c->name);
+      for(i = 0; i < N; i++) {
+        if(!alive[i]) {
+          vptree_add(vp, ptr[i]);
+          alive[i] = 1;
+          nalive++;
+        }
+      }
+      CHECK(vptree_npoints(vp) == N, tag, "npoints");
+      check_tree(vp, alive, nalive, tag);
+    }
+
+    vptree_destroy(vp);
+  }
+}
+
+/**
+ * Insert integer-valued points one at a time, so that many distances tie.
+ * Rebalancing must not rebuild the same subtrees over and over.
+ */
+static void check_ties(void)
+{
+  static const int nvalues[] = {100, 10, 1};
+  static double line[N];
+  const void *nn[K];
+  double nndist[K], q, best;
+  long ndist, budget;
+  int i, j, t, n, count;
+  unsigned seed;
+  char tag[64];
+  vptree_options vpopts;
+  vptree *vp;
+
+  vpopts = vptree_default_options;
+  vpopts.distance = line_distance;
+  vpopts.user_data = &ndist;
+
+  seed = 3;
+  for(t = 0; t < (int)(sizeof(nvalues) / sizeof(nvalues[0])); t++) {
+    snprintf(tag, sizeof(tag), "ties/%d", nvalues[t]);
+    for(i = 0; i < N; i++) {
+      line[i] = rand_r(&seed) % nvalues[t];
+    }
+
+    // Each insertion walks past the copies of its value, plus a
+    // logarithmic path to them
+    vp = vptree_create(sizeof(vpopts), &vpopts);
+    ndist = 0;
+    budget = (long)N * (N / nvalues[t] + 200);
+    for(n = 0; n < N && ndist < budget; n++) {
+      vptree_add(vp, &line[n]);
+    }
+    CHECK(n == N && ndist < budget, tag, "distance calls while inserting");
+
+    for(j = 0; j < 2 * nvalues[t] && j < 50; j++) {
+      q = 0.5 * j;
+      best = INFINITY;
+      count = 0;
+      for(i = 0; i < n; i++) {
+        if(fabs(q - line[i]) < best) {
+          best = fabs(q - line[i]);
+        }
+        if(line[i] == q) {
+          count++;
+        }
+      }
+
+      vptree_nearest_neighbor_dist(vp, &q, K, nn, nndist);
+      CHECK(nn[0] && nndist[0] == best, tag, "nearest_neighbor_dist");
+      CHECK(vptree_range_count(vp, &q, 0.25) == count, tag, "range_count");
+    }
+
+    vptree_destroy(vp);
+  }
+}
+
+/**
+ * Points inserted one at a time in sorted order would make a chain without
+ * rebalancing.  A nearest neighbor query should visit a logarithmic path.
+ */
+static void check_sorted(void)
+{
+  static double line[N];
+  const void *nn[1];
+  double q;
+  long ndist;
+  int i;
+  vptree_options vpopts;
+  vptree *vp;
+
+  vpopts = vptree_default_options;
+  vpopts.distance = line_distance;
+  vpopts.user_data = &ndist;
+
+  vp = vptree_create(sizeof(vpopts), &vpopts);
+  for(i = 0; i < N; i++) {
+    line[i] = i;
+    vptree_add(vp, &line[i]);
+  }
+
+  for(i = 0; i < N; i += 37) {
+    q = i + 0.25;
+    ndist = 0;
+    vptree_nearest_neighbor(vp, &q, 1, nn);
+    CHECK(nn[0] == &line[i], "sorted", "nearest_neighbor");
+    CHECK(ndist <= 3 * log2(N), "sorted", "depth after sorted insertions");
+  }
+
+  vptree_destroy(vp);
+}
+
+/**
+ * Progress must count each point once, also when adding to an existing tree
+ * splits full leaves and re-places their points.
+ */
+static void check_progress(void)
+{
+  static const int leaf_sizes[] = {1, 8, 16};
+  int i, j;
+  char tag[64];
+  progress_state state;
+  vptree_options vpopts;
+  vptree *vp;
+
+  vpopts = vptree_default_options;
+  vpopts.distance = distance;
+
+  for(i = 0; i < (int)(sizeof(leaf_sizes) / sizeof(leaf_sizes[0])); i++) {
+    snprintf(tag, sizeof(tag), "progress/leaf%d", leaf_sizes[i]);
+    vpopts.leaf_size = leaf_sizes[i];
+    vp = vptree_create(sizeof(vpopts), &vpopts);
+
+    for(j = 0; j < 2; j++) {
+      memset(&state, 0, sizeof(state));
+      vptree_add_many_progress(vp, N/2, ptr + j * (N/2), &state, progress);
+      CHECK(!state.bad, tag, "progress count past n or out of order");
+      CHECK(state.i == N/2 && state.n == N/2, tag, "final progress");
+    }
+    CHECK(vptree_npoints(vp) == N, tag, "npoints");
+
+    vptree_destroy(vp);
+  }
+}
+
+/**
+ * Parallel construction, large enough to spawn tasks, must give the same
+ * tree as a serial one with the same seed, whether built at once or added
+ * to an existing tree.
+ */
+static void check_parallel(void)
+{
+  static double many[PARALLEL_N * DIM];
+  static const void *mptr[PARALLEL_N];
+  int i, j, t, batches;
+  unsigned seed;
+  char tag[64];
+  double q[DIM];
+  const void *nn[K], *pnn[K];
+  double queries[TRIALS * DIM];
+  const void *qptr[TRIALS], *batch[TRIALS * K];
+  progress_state state;
+  vptree_options vpopts;
+  vptree *vp, *pvp;
+
+  seed = 11;
+  frandvec(&seed, PARALLEL_N * DIM, many, 0, 1);
+  for(i = 0; i < PARALLEL_N; i++) {
+    mptr[i] = many + DIM * i;
+  }
+
+  vpopts = vptree_default_options;
+  vpopts.distance = distance;
+
+  for(batches = 1; batches <= 2; batches++) {
+    snprintf(tag, sizeof(tag), "parallel/%d", batches);
+
+    vpopts.num_threads = 0;
+    vp = vptree_create(sizeof(vpopts), &vpopts);
+    vpopts.num_threads = THREADS;
+    pvp = vptree_create(sizeof(vpopts), &vpopts);
+
+    for(j = 0; j < batches; j++) {
+      vptree_add_many(vp, PARALLEL_N / batches, mptr + j * (PARALLEL_N / batches));
+
+      memset(&state, 0, sizeof(state));
+      vptree_add_many_progress(pvp, PARALLEL_N / batches, mptr + j * (PARALLEL_N / batches),
+                               &state, progress);
+      CHECK(!state.bad && state.i == PARALLEL_N / batches, tag, "progress");
+    }
+    CHECK(vptree_npoints(pvp) == PARALLEL_N, tag, "npoints");
+
+    for(t = 0; t < TRIALS; t++) {
+      frandvec(&seed, DIM, q, 0, 1);
+      vptree_nearest_neighbor(vp, q, K, nn);
+      vptree_nearest_neighbor(pvp, q, K, pnn);
+      for(i = 0; i < K; i++) {
+        CHECK(nn[i] && pnn[i] == nn[i], tag, "same neighbors as a serial build");
+      }
+    }
+
+    // Batched queries shared between threads
+    for(t = 0; t < TRIALS; t++) {
+      frandvec(&seed, DIM, queries + DIM * t, 0, 1);
+      qptr[t] = queries + DIM * t;
+    }
+    vptree_nearest_neighbor_many(pvp, TRIALS, qptr, K, batch);
+    for(t = 0; t < TRIALS; t++) {
+      vptree_nearest_neighbor(vp, qptr[t], K, nn);
+      for(i = 0; i < K; i++) {
+        CHECK(batch[t*K + i] == nn[i], tag, "nearest_neighbor_many");
+      }
+    }
+
+    vptree_destroy(pvp);
+    vptree_destroy(vp);
+  }
+}
+
+static void check_tree(vptree *vp, const int *alive, int nalive, const char *tag)
+{
+  int t, i, n, m, got, total, finished;
+  unsigned seed;
+  double q[DIM], r, d, prev;
+  double *ref, *nbdist;
+  const void *nn[MAX_K], *p, **nb;
+  double nndist[MAX_K];
+  double queries[TRIALS * DIM];
+  const void *qptr[TRIALS], *batch[TRIALS * K], **many;
+  const void *ctxnn[MAX_K];
+  const void **buffer;
+  double *bufdist;
+  int capacity;
+  visit_state vs;
+  vptree_incnn *inc;
+  vptree_query_ctx *ctx;
+
+  static const double eps[] = {0, 0.1, 0.5, 2.0};
+  static const int ctx_k[] = {1, MAX_K, 3, K, 2*K};
+  static const int ctx_nodes[] = {N, 16, 1, 200};
+
+  ctx = vptree_query_ctx_create(vp);
+  CHECK(ctx != NULL, tag, "query_ctx_create");
+
+  buffer = NULL;
+  bufdist = NULL;
+  capacity = 0;
+
+  seed = 7;
+  for(t = 0; t < TRIALS; t++) {
+    // Random queries, and every fourth one a point of the tree
+    frandvec(&seed, DIM, q, 0, 1);
+    if(t % 4 == 0) {
+      memcpy(q, points + DIM * ((t * 37) % N), sizeof(q));
+    }
+    ref = exhaustive_distances(q, alive);
+
+    // Exact and approximate k-NN
+    vptree_nearest_neighbor_dist(vp, q, K, nn, nndist);
+    for(i = 0; i < K; i++) {
+      CHECK(nn[i] && nndist[i] == distance(NULL, q, nn[i]) && SAME(nndist[i], ref[i]),
+            tag, "nearest_neighbor_dist");
+    }
+
+    vptree_nearest_neighbor_approx_dist(vp, q, K, nn, nndist, N);
+    for(i = 0; i < K; i++) {
+      CHECK(nn[i] && SAME(nndist[i], ref[i]), tag, "approx with every node");
+    }
+
+    vptree_nearest_neighbor_approx_dist(vp, q, K, nn, nndist, 16);
+    for(i = 0; i < K; i++) {
+      CHECK(nn[i] ? nndist[i] == distance(NULL, q, nn[i]) : isinf(nndist[i]),
+            tag, "approx distances");
+    }
+
+    m = (t % 3 == 0) ? MAX_K : 3*K;
+    vptree_nearest_neighbor(vp, q, m, nn);
+    for(i = 0; i < m; i++) {
+      CHECK(i < nalive ? nn[i] && SAME(distance(NULL, q, nn[i]), ref[i]) : nn[i] == NULL,
+            tag, "nearest_neighbor with large k");
+    }
+
+    // A query context reused as k and max_nodes grow and shrink
+    m = ctx_k[t % 5];
+    n = ctx_nodes[t % 4];
+    vptree_nearest_neighbor_ctx(ctx, q, m, ctxnn);
+    for(i = 0; i < m; i++) {
+      CHECK(i < nalive ? ctxnn[i] && SAME(distance(NULL, q, ctxnn[i]), ref[i]) : ctxnn[i] == NULL,
+            tag, "nearest_neighbor_ctx");
+    }
+
+    vptree_nearest_neighbor_approx_ctx(ctx, q, m, ctxnn, n);
+    vptree_nearest_neighbor_approx(vp, q, m, nn, n);
+    for(i = 0; i < m; i++) {
+      CHECK(ctxnn[i] == nn[i], tag, "nearest_neighbor_approx_ctx");
+    }
+
+    finished = vptree_nearest_neighbor_deadline_ctx(ctx, q, m, ctxnn, nndist, LLONG_MAX);
+    CHECK(finished == 1, tag, "nearest_neighbor_deadline_ctx status");
+    for(i = 0; i < m && i < nalive; i++) {
+      CHECK(ctxnn[i] && SAME(nndist[i], ref[i]), tag, "nearest_neighbor_deadline_ctx");
+    }
+
+    // Relative error bound
+    for(m = 0; m < (int)(sizeof(eps) / sizeof(eps[0])); m++) {
+      finished = vptree_nearest_neighbor_eps(vp, q, K, nn, nndist, eps[m]);
+      CHECK(finished == 0 || finished == 1, tag, "nearest_neighbor_eps status");
+      CHECK(eps[m] > 0 || finished == 1, tag, "nearest_neighbor_eps exact without eps");
+      for(i = 0; i < K; i++) {
+        CHECK(nn[i] && nndist[i] == distance(NULL, q, nn[i]), tag, "nearest_neighbor_eps distances");
+        CHECK(nndist[i] <= (1 + eps[m]) * ref[i] + 1e-12, tag, "nearest_neighbor_eps bound");
+        CHECK(!finished || SAME(nndist[i], ref[i]), tag, "nearest_neighbor_eps exact flag");
+      }
+    }
+
+    // Deadlines
+    finished = vptree_nearest_neighbor_deadline(vp, q, K, nn, nndist, 1000000000LL);
+    CHECK(finished == 1, tag, "generous deadline");
+    for(i = 0; i < K; i++) {
+      CHECK(nn[i] && SAME(nndist[i], ref[i]), tag, "generous deadline results");
+    }
+
+    // Budgets that reach past the end of the clock are no limit
+    for(m = 0; m < 2; m++) {
+      finished = vptree_nearest_neighbor_deadline(vp, q, K, nn, nndist, LLONG_MAX - m);
+      CHECK(finished == 1, tag, "unlimited deadline");
+      for(i = 0; i < K; i++) {
+        CHECK(nn[i] && SAME(nndist[i], ref[i]), tag, "unlimited deadline results");
+      }
+    }
+
+    finished = vptree_nearest_neighbor_deadline(vp, q, K, nn, nndist, 0);
+    CHECK(finished == 0 || finished == 1, tag, "spent deadline status");
+    for(i = 0; i < K; i++) {
+      CHECK(nn[i] ? nndist[i] == distance(NULL, q, nn[i]) && nndist[i] >= ref[i] - 1e-12
+                  : isinf(nndist[i]), tag, "spent deadline results");
+      CHECK(i == 0 || nndist[i] >= nndist[i-1], tag, "spent deadline order");
+      CHECK(!finished || SAME(nndist[i], ref[i]), tag, "spent deadline finished flag");
+    }
+
+    // Range searches at the K-th neighbor, the median and past every point
+    for(m = 0; m < 3; m++) {
+      r = (m == 0) ? ref[K] : (m == 1) ? ref[nalive/2] : 10.0;
+      n = exhaustive_count(ref, nalive, r);
+
+      CHECK(vptree_range_count(vp, q, r) == n, tag, "range_count");
+
+      nb = vptree_neighborhood_dist(vp, q, r, &got, &nbdist);
+      CHECK(got == n, tag, "neighborhood_dist count");
+      for(i = 0; i < got; i++) {
+        CHECK(nbdist[i] == distance(NULL, q, nb[i]) && nbdist[i] < r, tag, "neighborhood_dist");
+      }
+      free(nb);
+      free(nbdist);
+
+      vs.q = q;
+      vs.n = vs.stop = vs.bad = 0;
+      CHECK(vptree_neighborhood_visit(vp, q, r, &vs, visit) == 0, tag, "neighborhood_visit status");
+      CHECK(vs.n == n && vs.bad == 0, tag, "neighborhood_visit");
+
+      vs.n = vs.bad = 0;
+      vs.stop = 3;
+      CHECK(vptree_neighborhood_visit(vp, q, r, &vs, visit) != 0, tag, "neighborhood_visit stop status");
+      CHECK(vs.n == 3, tag, "neighborhood_visit stop");
+
+      got = vptree_neighborhood_buffer(vp, q, r, &buffer, &bufdist, &capacity);
+      CHECK(got == n && capacity >= got, tag, "neighborhood_buffer count");
+      for(i = 0; i < got; i++) {
+        CHECK(bufdist[i] == distance(NULL, q, buffer[i]) && bufdist[i] < r, tag, "neighborhood_buffer");
+      }
+      CHECK(vptree_neighborhood_buffer(vp, q, r, &buffer, NULL, &capacity) == n,
+            tag, "neighborhood_buffer without distances");
+    }
+
+    // Incremental search, one at a time and in batches
+    inc = vptree_incnn_begin(vp, q);
+    for(i = 0; i < 3*K; i++) {
+      p = vptree_incnn_next_dist(inc, &d);
+      CHECK(p && d == distance(NULL, q, p) && SAME(d, ref[i]), tag, "incnn_next_dist");
+    }
+    vptree_incnn_end(inc);
+
+    inc = vptree_incnn_begin(vp, q);
+    for(total = 0, m = 1; total < nalive; m = m % 37 + 1) {
+      got = vptree_incnn_next_many(inc, m, nn, (m % 3) ? nndist : NULL);
+      CHECK(got == m || total + got == nalive, tag, "incnn_next_many count");
+      for(i = 0; i < got; i++) {
+        CHECK(SAME(distance(NULL, q, nn[i]), ref[total + i]), tag, "incnn_next_many");
+        CHECK(!(m % 3) || nndist[i] == distance(NULL, q, nn[i]), tag, "incnn_next_many distances");
+      }
+      total += got;
+      if(got < m) {
+        break;
+      }
+    }
+    CHECK(total == nalive, tag, "incnn_next_many total");
+    CHECK(vptree_incnn_next(inc) == NULL, tag, "incnn_next after the last point");
+    vptree_incnn_end(inc);
+
+    if(t % 8 == 0) {
+      inc = vptree_incnn_begin(vp, q);
+      prev = 0;
+      for(n = 0; (p = vptree_incnn_next_dist(inc, &d)) != NULL; n++) {
+        CHECK(d >= prev && SAME(d, ref[n]), tag, "incnn_next_dist enumeration");
+        prev = d;
+      }
+      CHECK(n == nalive, tag, "incnn_next_dist enumeration count");
+      vptree_incnn_end(inc);
+    }
+
+    // Distance cutoff, which can only be lowered
+    r = ref[nalive > 70 ? 70 : nalive - 1];
+    n = exhaustive_count(ref, nalive, r);
+    inc = vptree_incnn_begin(vp, q);
+    vptree_incnn_set_max_distance(inc, 2*r);
+    vptree_incnn_set_max_distance(inc, r);
+    vptree_incnn_set_max_distance(inc, 3*r);
+    for(got = 0; (p = vptree_incnn_next(inc)) != NULL; got++) {
+      CHECK(distance(NULL, q, p) < r, tag, "incnn_set_max_distance");
+    }
+    CHECK(got == n, tag, "incnn_set_max_distance count");
+    vptree_incnn_end(inc);
+
+    free(ref);
+  }
+
+  // Batched queries, and a batch with k past the number of points
+  for(t = 0; t < TRIALS; t++) {
+    frandvec(&seed, DIM, queries + DIM * t, 0, 1);
+    qptr[t] = queries + DIM * t;
+  }
+  vptree_nearest_neighbor_many(vp, TRIALS, qptr, K, batch);
+  for(t = 0; t < TRIALS; t++) {
+    vptree_nearest_neighbor(vp, qptr[t], K, nn);
+    for(i = 0; i < K; i++) {
+      CHECK(batch[t*K + i] && SAME(distance(NULL, qptr[t], batch[t*K + i]),
+                                   distance(NULL, qptr[t], nn[i])),
+            tag, "nearest_neighbor_many");
+    }
+  }
+
+  m = nalive + 2;
+  many = (const void **)malloc(sizeof(const void *) * 2 * m);
+  vptree_nearest_neighbor_many(vp, 2, qptr, m, many);
+  for(t = 0; t < 2; t++) {
+    for(i = 0; i < m; i++) {
+      CHECK((i < nalive) == (many[t*m + i] != NULL), tag, "nearest_neighbor_many with large k");
+    }
+  }
+  free(many);
+
+  vptree_query_ctx_destroy(ctx);
+  free(buffer);
+  free(bufdist);
+}
+
+static double frand(unsigned *seed, double a, double b)
+{
+  int r;
+
+  r = rand_r(seed);
+
+  return (r/(double)RAND_MAX) * (b-a) + a;
+}
+
+static void frandvec(unsigned *seed, int n, double *p, double a, double b)
+{
+  int i;
+
+  for(i = 0; i < n; i++) {
+    p[i] = frand(seed, a, b);
+  }
+}
+
+static double distance(void *user_data, const void *p1, const void *p2)
+{
+  return geom_distance(DIM, (const double *)p1, (const double *)p2);
+}
+
+static double distance_bounded(void *user_data, const void *p1, const void *p2,
+                               double bound)
+{
+  return geom_l2distance_bounded(DIM, (const double *)p1, (const double *)p2, bound);
+}
+
+static void distance_many(void *user_data, const void *q, int n,
+                          const void * const *p, double *dist)
+{
+  int i;
+
+  for(i = 0; i < n; i++) {
+    dist[i] = geom_distance(DIM, (const double *)q, (const double *)p[i]);
+  }
+}
+
+// Distance on the real line, counting calls in *user_data
+static double line_distance(void *user_data, const void *p1, const void *p2)
+{
+  (*(long *)user_data)++;
+
+  return fabs(*(const double *)p1 - *(const double *)p2);
+}
+
+static void progress(void *user_data, int i, int n)
+{
+  progress_state *state = (progress_state *)user_data;
+
+  if(i < state->i || i > n) {
+    state->bad = 1;
+  }
+  state->i = i;
+  state->n = n;
+}
+
+static int visit(void *user_data, const void *p, double d)
+{
+  visit_state *vs = (visit_state *)user_data;
+
+  vs->n++;
+  if(d != distance(NULL, vs->q, p)) {
+    vs->bad++;
+  }
+
+  return vs->stop && vs->n >= vs->stop;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+// Sorted distances from q to every live point
+static double *exhaustive_distances(const double *q, const int *alive)
+{
+  int i, m;
+  double *d;
+
+  d = (double *)malloc(sizeof(double) * N);
+  m = 0;
+  for(i = 0; i < N; i++) {
+    if(!alive || alive[i]) {
+      d[m++] = geom_distance(DIM, q, points + DIM * i);
+    }
+  }
+  qsort(d, m, sizeof(double), compare_doubles);
+
+  return d;
+}
+
+static int exhaustive_count(const double *ref, int n, double r)
+{
+  int i, m;
+
+  m = 0;
+  for(i = 0; i < n; i++) {
+    if(ref[i] < r) {
+      m++;
+    }
+  }
+
+  return m;
+}
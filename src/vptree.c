@@ -2,12 +2,20 @@
 #include <memory.h>
 #include <assert.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "vptree.h"
 #include "vptree_struct.h"
 #include "pqueue.h"
 #include "math.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #ifndef INFINITY
 #define INFINITY HUGE_VAL
 #endif
@@ -35,14 +43,216 @@ const vptree_options vptree_default_options = {
   .allocate = default_allocate,
   .deallocate = default_deallocate,
   .reallocate = default_reallocate,
+  .num_threads = 0,
+  .vantage = VPTREE_VANTAGE_RANDOM,
+  .vantage_samples = 8,
+  .seed = 0,
+  .leaf_size = 1,
+  .slab_size = 0,
+  .rebalance_alpha = 0.75,
+  .compact_ratio = 0.5,
+  .pivot_history = 0,
+  .arity = 2,
+  .distance_bounded = NULL,
+  .distance_many = NULL,
 };
 
+/////////////////////////////// Node Memory ///////////////////////////////
+
+/**
+ * Size of a node together with its mu, bound, child and anc arrays
+ */
+static size_t node_bytes(const vptree *vp)
+{
+  return sizeof(node) + sizeof(node *) * vp->opts.arity +
+    sizeof(double) * (3 * vp->opts.arity - 1 + vp->opts.pivot_history);
+}
+
+/**
+ * The bound array of split node @c nd, following mu
+ */
+static double *node_bound(const vptree *vp, const node *nd)
+{
+  return (double *)nd->mu + vp->opts.arity - 1;
+}
+
+/**
+ * The child array of @c nd, following bound
+ */
+static node **node_child(const vptree *vp, const node *nd)
+{
+  return (node **)(node_bound(vp, nd) + 2 * vp->opts.arity);
+}
+
+/**
+ * The pivot history of @c nd, following child, or NULL if the tree keeps
+ * none
+ */
+static double *node_anc(const vptree *vp, const node *nd)
+{
+  if(vp->opts.pivot_history == 0) {
+    return NULL;
+  }
+  return (double *)(node_child(vp, nd) + vp->opts.arity);
+}
+
+/**
+ * The bucket of leaf node @c nd, kept where a split node has its bounds
+ */
+static leaf *node_leaf(const vptree *vp, const node *nd)
+{
+  return (leaf *)node_bound(vp, nd);
+}
+
+static void init_node_memory(vptree *vp)
+{
+  size_t h;
+
+  // A leaf's bucket fits where a split node keeps its bounds
+  assert(sizeof(leaf) <= sizeof(double) * 2 * vp->opts.arity);
+
+  h = vp->opts.pivot_history;
+  arena_init(&vp->arena, vp->opts.slab_size,
+             vp->opts.allocate, vp->opts.deallocate, vp->opts.user_data);
+  arena_pool_init(&vp->node_pool, node_bytes(vp));
+  arena_pool_init(&vp->bucket_pool, sizeof(bucketp) * (vp->opts.leaf_size - 1));
+  arena_pool_init(&vp->bucket_anc_pool, sizeof(double) * h * (vp->opts.leaf_size - 1));
+}
+
+static node *node_alloc(vptree *vp)
+{
+  node *nd;
+
+  if(vp->opts.slab_size == 0) {
+    nd = (node *)allocate(vp, node_bytes(vp));
+  }
+  else {
+    #pragma omp critical(vptree_arena)
+    nd = (node *)arena_pool_alloc(&vp->arena, &vp->node_pool);
+  }
+
+  return nd;
+}
+
+static void node_free(vptree *vp, node *nd)
+{
+  if(vp->opts.slab_size == 0) {
+    deallocate(vp, nd);
+    return;
+  }
+
+  #pragma omp critical(vptree_arena)
+  arena_pool_free(&vp->node_pool, nd);
+}
+
+/**
+ * Make room in bucket @c lf for @c n points.  Buckets from the arena always
+ * have room for a full leaf.
+ */
+static int bucket_reserve(vptree *vp, leaf *lf, int n)
+{
+  size_t h;
+  bucketp *bucket;
+  double *anc;
+
+  h = vp->opts.pivot_history;
+  if(vp->opts.slab_size == 0) {
+    bucket = (bucketp *)reallocate(vp, lf->bucket, sizeof(bucketp) * n);
+    if(bucket == NULL) {
+      return -1;
+    }
+    lf->bucket = bucket;
+
+    if(h > 0) {
+      anc = (double *)reallocate(vp, lf->anc, sizeof(double) * h * n);
+      if(anc == NULL) {
+        return -1;
+      }
+      lf->anc = anc;
+    }
+  }
+  else {
+    #pragma omp critical(vptree_arena)
+    {
+      if(lf->bucket == NULL) {
+        lf->bucket = (bucketp *)arena_pool_alloc(&vp->arena, &vp->bucket_pool);
+      }
+      if(h > 0 && lf->anc == NULL) {
+        lf->anc = (double *)arena_pool_alloc(&vp->arena, &vp->bucket_anc_pool);
+      }
+    }
+
+    if(lf->bucket == NULL || (h > 0 && lf->anc == NULL)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Free bucket @c lf, leaving it empty
+ */
+static void bucket_release(vptree *vp, leaf *lf)
+{
+  if(vp->opts.slab_size == 0) {
+    if(lf->bucket != NULL) {
+      deallocate(vp, lf->bucket);
+    }
+    if(lf->anc != NULL) {
+      deallocate(vp, lf->anc);
+    }
+  }
+  else {
+    #pragma omp critical(vptree_arena)
+    {
+      arena_pool_free(&vp->bucket_pool, lf->bucket);
+      arena_pool_free(&vp->bucket_anc_pool, lf->anc);
+    }
+  }
+
+  lf->nbucket = 0;
+  lf->bucket = NULL;
+  lf->anc = NULL;
+}
+
+/////////////////////////////// Node Shells ///////////////////////////////
+
+static bool is_leaf(const node *nd)
+{
+  return nd->mu[0] < 0;
+}
+
+/**
+ * Range of distances [*lo, *hi] from the vantage point of split node @c nd
+ * to the points below child @c i.  Empty (*lo > *hi) if none were added.
+ */
+static void child_range(const vptree *vp, const node *nd, int i, double *lo, double *hi)
+{
+  const double *bound = node_bound(vp, nd);
+
+  *lo = bound[2*i];
+  *hi = bound[2*i + 1];
+}
+
+/**
+ * Index of the child of split node @c nd covering distance @c d
+ */
+static int shell_index(const vptree *vp, const node *nd, double d)
+{
+  int i;
+
+  for(i = 0; i < vp->opts.arity - 1 && d >= nd->mu[i]; i++);
+
+  return i;
+}
+
 /////////////////////////////// vp-tree Construction ////////////////////////
 
-typedef struct distp distp;
-static node *node_create(vptree *vp, node *parent, int n, distp *dp, int *alli, int alln, void *user_data, void (*callback)(void *user_data, int i, int n));
+typedef struct build_ctx build_ctx;
+static node *node_create(vptree *vp, node *parent, int n, distp *dp, build_ctx *build, uint64_t rng, int depth);
 static void node_destroy(vptree *vp, node *nd);
-static int node_add(vptree *vp, node *nd, int n, distp *dp, int *alli, int alln, void *user_data, void (*callback)(void *user_data, int i, int n));
+static int node_add(vptree *vp, node *nd, int n, distp *dp, build_ctx *build, uint64_t rng, int depth);
 
 vptree *vptree_create(size_t opts_size, const vptree_options *opts)
 {
@@ -60,31 +270,69 @@ vptree *vptree_create(size_t opts_size, const vptree_options *opts)
     opts_size = sizeof(vp->opts);
   }
   memcpy(&vp->opts, opts, opts_size);
+  if(vp->opts.leaf_size < 1) {
+    vp->opts.leaf_size = 1;
+  }
+  if(vp->opts.pivot_history < 0) {
+    vp->opts.pivot_history = 0;
+  }
+  else if(vp->opts.pivot_history > VPTREE_MAX_PIVOT_HISTORY) {
+    vp->opts.pivot_history = VPTREE_MAX_PIVOT_HISTORY;
+  }
+  if(vp->opts.arity < 2) {
+    vp->opts.arity = 2;
+  }
+  else if(vp->opts.arity > VPTREE_MAX_ARITY) {
+    vp->opts.arity = VPTREE_MAX_ARITY;
+  }
 
   // Empty tree
   vp->root = NULL;
   vp->n = 0;
+  vp->rng = (uint64_t)vp->opts.seed;
+  vp->frozen = NULL;
+  init_node_memory(vp);
 
   return vp;
 }
 
 static node *node_clone(vptree *vp, node *parent, const node *src)
 {
-  node *dst;
+  node *dst, **child;
+  const leaf *from;
+  leaf *to;
+  size_t h;
+  int i;
 
   if(src == NULL) {
     return NULL;
   }
 
-  dst = (node *)allocate(vp, sizeof(node));
-  dst->vp = vp;
+  dst = node_alloc(vp);
+  memcpy(dst, src, node_bytes(vp));
+  dst->parent = parent;
 
-  dst->p = src->p;
-  dst->mu = src->mu;
+  if(!is_leaf(src)) {
+    child = node_child(vp, dst);
+    for(i = 0; i < vp->opts.arity; i++) {
+      child[i] = node_clone(vp, dst, child[i]);
+    }
+    return dst;
+  }
 
-  dst->parent = parent;
-  dst->lt = node_clone(vp, dst, src->lt);
-  dst->ge = node_clone(vp, dst, src->ge);
+  // The copied bucket still points at the source's storage
+  h = vp->opts.pivot_history;
+  from = node_leaf(vp, src);
+  to = node_leaf(vp, dst);
+  to->bucket = NULL;
+  to->anc = NULL;
+  if(from->nbucket > 0) {
+    bucket_reserve(vp, to, from->nbucket);
+    memcpy(to->bucket, from->bucket, sizeof(bucketp) * from->nbucket);
+    if(h > 0) {
+      memcpy(to->anc, from->anc, sizeof(double) * h * from->nbucket);
+    }
+  }
 
   return dst;
 }
@@ -97,6 +345,9 @@ vptree *vptree_clone(const vptree *src)
   dst = (vptree *)allocate(src, sizeof(vptree));
   dst->opts = src->opts;
   dst->n = src->n;
+  dst->rng = src->rng;
+  dst->frozen = NULL;
+  init_node_memory(dst);
 
   // Copy nodes
   dst->root = node_clone(dst, NULL, src->root);
@@ -106,13 +357,23 @@ vptree *vptree_clone(const vptree *src)
 
 static void node_destroy(vptree *vp, node *nd)
 {
+  node **child;
+  int i;
+
   if(nd == NULL) {
     return;
   }
 
-  node_destroy(vp, nd->lt);
-  node_destroy(vp, nd->ge);
-  deallocate(vp, nd);
+  if(is_leaf(nd)) {
+    bucket_release(vp, node_leaf(vp, nd));
+  }
+  else {
+    child = node_child(vp, nd);
+    for(i = 0; i < vp->opts.arity; i++) {
+      node_destroy(vp, child[i]);
+    }
+  }
+  node_free(vp, nd);
 }
 
 void vptree_destroy(vptree *vp)
@@ -121,7 +382,13 @@ void vptree_destroy(vptree *vp)
     return;
   }
 
-  node_destroy(vp, vp->root);
+  if(vp->frozen != NULL) {
+    deallocate(vp, vp->frozen);
+  }
+  else if(vp->opts.slab_size == 0) {
+    node_destroy(vp, vp->root);
+  }
+  arena_destroy(&vp->arena);
   deallocate(vp, vp);
 }
 
@@ -137,412 +404,2624 @@ int vptree_npoints(const vptree *vp)
 
 ///////////////////////////// vp-tree Addition /////////////////////////
 
-typedef struct distp {
-  double d;
-  const void *p;
-} distp;
+/**
+ * SplitMix64 generator.  Every node draws from its own state, derived from
+ * its parent's, so a build is reproducible regardless of how its subtrees
+ * are scheduled across threads.
+ */
+static uint64_t rng_next(uint64_t *state)
+{
+  uint64_t z;
 
-static node *node_create(vptree *vp, node *parent, int n, distp *dp, int *alli, int alln, void *user_data, void (*callback)(void *user_data, int i, int n))
+  z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+static int rng_uniform(uint64_t *state, int n)
 {
-  node *nd;
-  int v;
-  const void *p, *swap;
-  int stat;
+  return (int)(rng_next(state) % (uint64_t)n);
+}
 
-  // Null node
-  if(n == 0) {
-    return NULL;
+static int select_vantage(vptree *vp, const node *ref, int n, distp *dp, uint64_t *rng);
+static void swap_distp(distp *dp, int i, int j);
+
+/**
+ * Copy the pivot history of @c dp, for a node at depth @c depth, to @c anc
+ * (parent first)
+ */
+static void hist_to_anc(int h, const distp *dp, int depth, double *anc)
+{
+  int j;
+
+  for(j = 0; j < h; j++) {
+    anc[j] = (j < depth) ? dp->hist[(depth - 1 - j) % h] : -1;
   }
+}
 
-  nd = allocate(vp, sizeof(node));
-  if(nd == NULL) {
-    return NULL;
+/**
+ * Inverse of hist_to_anc
+ */
+static void anc_to_hist(int h, const double *anc, int depth, double *hist)
+{
+  int j;
+
+  for(j = 0; j < h && j < depth; j++) {
+    hist[(depth - 1 - j) % h] = anc[j];
   }
-  nd->vp = vp;
-  nd->parent = parent;
+}
 
-  // Update progress
-  if(callback != NULL) {
-    (*alli)++;
-    callback(user_data, *alli, alln);
+/**
+ * Subsets smaller than this are built serially, even in a parallel build.
+ * Keeps task overhead small relative to the work in each task.
+ */
+#define PARALLEL_CUTOFF (4096)
+
+/**
+ * State shared between all nodes of a single bulk build
+ */
+struct build_ctx {
+  /**
+   * Nonzero if subtrees and distance loops may run as OpenMP tasks
+   */
+  bool parallel;
+
+  /**
+   * Progress reporting
+   */
+  int i, n;
+  void *user_data;
+  void (*callback)(void *user_data, int i, int n);
+};
+
+/**
+ * Report @c n more points placed in the tree
+ */
+static void build_progress(build_ctx *build, int n)
+{
+  if(build->callback == NULL) {
+    return;
+  }
+
+  #pragma omp critical(vptree_progress)
+  {
+    build->i += n;
+    build->callback(build->user_data, build->i, build->n);
   }
+}
+
+/**
+ * Make @c nd, at depth @c depth, the root of a new subtree holding the @c n
+ * points in @c dp.
+ *
+ * @arg @c ref If non-NULL, the distances in @c dp are to @c ref->p
+ */
+static int node_build(vptree *vp, node *nd, const node *ref, int n, distp *dp, build_ctx *build, uint64_t rng, int depth)
+{
+  node **child;
+  leaf *lf;
+  int i, v;
 
   // Select reference node
-  // TODO
-  v = rand() % n;
-  nd->p = p = dp[v].p;
+  v = select_vantage(vp, ref, n, dp, &rng);
+  if(v == -1) {
+    return -1;
+  }
+  nd->p = dp[v].p;
+  if(vp->opts.pivot_history > 0) {
+    hist_to_anc(vp->opts.pivot_history, &dp[v], depth, node_anc(vp, nd));
+  }
 
   // Initalize as singleton node
-  nd->mu = -1;
-  nd->lt = nd->ge = NULL;
+  nd->mu[0] = -1;
+  child = node_child(vp, nd);
+  for(i = 0; i < vp->opts.arity; i++) {
+    child[i] = NULL;
+  }
+  lf = node_leaf(vp, nd);
+  lf->nbucket = 0;
+  lf->bucket = NULL;
+  lf->anc = NULL;
+  nd->size = 1;
+  nd->ndeleted = 0;
+  nd->deleted = false;
+  nd->rebuild_size = n + n/2;
+  nd->radius = 0;
 
-  if(n != 1) {
-    // Add subnodes
-    swap = dp[0].p;
-    dp[0].p = dp[v].p;
-    dp[v].p = swap;
+  // Update progress
+  build_progress(build, 1);
 
-    stat = node_add(vp, nd, n-1, dp+1, alli, alln, user_data, callback);
-    if(stat == -1) {
-      deallocate(vp, nd);
-      return NULL;
-    }
+  if(n == 1) {
+    return 0;
   }
 
-  return nd;
+  // Add subnodes
+  swap_distp(dp, 0, v);
+
+  return node_add(vp, nd, n-1, dp+1, build, rng, depth);
 }
 
-static int compare_distp(const void *v1, const void *v2)
+static node *node_create(vptree *vp, node *parent, int n, distp *dp, build_ctx *build, uint64_t rng, int depth)
 {
-  double d1, d2;
-
-  d1 = ((const distp *)v1)->d;
-  d2 = ((const distp *)v2)->d;
+  node *nd;
 
-  if(d1 < d2) {
-    return -1;
+  // Null node
+  if(n == 0) {
+    return NULL;
   }
-  else if(d1 == d2) {
-    return 0;
+
+  nd = node_alloc(vp);
+  if(nd == NULL) {
+    return NULL;
   }
-  else {
-    return 1;
+  nd->parent = parent;
+
+  if(node_build(vp, nd, parent, n, dp, build, rng, depth) == -1) {
+    node_free(vp, nd);
+    return NULL;
   }
+
+  return nd;
 }
 
-static void sort_distp(int n, distp *dp)
+/**
+ * Subsets at most this size are finished with an insertion sort.
+ */
+#define SELECT_SMALL (16)
+
+static void swap_distp(distp *dp, int i, int j)
 {
-  qsort(dp, (size_t)n, sizeof(distp), compare_distp);
+  distp tmp;
+
+  tmp = dp[i];
+  dp[i] = dp[j];
+  dp[j] = tmp;
 }
 
-static int node_add(vptree *vp, node *nd, int n, distp *dp, int *alli, int alln, void *user_data, void (*callback)(void *user_data, int i, int n))
+static void insertion_sort_distp(int n, distp *dp)
 {
-  distp *lt, *ge;
-  int i, m;
-  int stat;
-
-  // Calculate distances
-  for(i = 0; i < n; i++) {
-    dp[i].d = distance(vp, nd->p, dp[i].p);
+  int i, j;
+  distp tmp;
 
-    if(dp[i].d < 0) {
-      return -1;
+  for(i = 1; i < n; i++) {
+    tmp = dp[i];
+    for(j = i; j > 0 && dp[j-1].d > tmp.d; j--) {
+      dp[j] = dp[j-1];
     }
-
-    //if(i % (1024) == 0) {
-    //  fprintf(stderr, "Distance %d of %d (%.2f%%)\n", i, n, (((float)i)*100)/n);
-    //}
+    dp[j] = tmp;
   }
-  //fprintf(stderr, "Sorting...\n");
-  sort_distp(n, dp);
+}
 
-  // Previously a leaf node, find median distance
-  if(nd->mu < 0) {
-    // Find median distance
-    m = n/2;
+static void sift_down_distp(int n, distp *dp, int i)
+{
+  int child;
 
-    if(n % 2 == 0) {
-      if(n == 2) {
-        m = 0;
-      }
-      nd->mu = (dp[m].d + dp[m+1].d)/2;
+  for(child = 2*i + 1; child < n; i = child, child = 2*i + 1) {
+    if(child + 1 < n && dp[child].d < dp[child+1].d) {
+      child++;
     }
-    else {
-      nd->mu = dp[m].d;
+    if(dp[i].d >= dp[child].d) {
+      break;
     }
+    swap_distp(dp, i, child);
   }
+}
+
+static void heap_sort_distp(int n, distp *dp)
+{
+  int i;
 
-  for(m = 0; m < n && dp[m].d < nd->mu; m++);
-  //fprintf(stderr, "Split at m = %d (of %d), dist = %lg\n", m, n, nd->mu);
+  for(i = n/2 - 1; i >= 0; i--) {
+    sift_down_distp(n, dp, i);
+  }
+  for(i = n - 1; i > 0; i--) {
+    swap_distp(dp, 0, i);
+    sift_down_distp(i, dp, 0);
+  }
+}
 
-  // TODO: case with equal distances
-  // Add lt nodes
-  lt = dp;
-  if(m > 0) {
-    if(nd->lt == NULL) {
-      nd->lt = node_create(vp, nd, m, lt, alli, alln, user_data, callback);
-      if(nd->lt == NULL) {
-        return -1;
-      }
+/**
+ * Partially order @c dp by distance so that element @c k is in its sorted
+ * position, with no greater distances before it and no smaller after it.
+ *
+ * Introselect: quickselect with a median-of-three pivot, falling back to a
+ * heap sort of the remaining range if partitioning stops making progress.
+ */
+static void select_distp(int n, distp *dp, int k)
+{
+  int lo, hi, mid, i, j, depth;
+  double pivot;
+
+  lo = 0;
+  hi = n - 1;
+  for(depth = 0, i = n; i > 0; i >>= 1) {
+    depth += 2;
+  }
+
+  while(hi - lo >= SELECT_SMALL) {
+    if(depth-- == 0) {
+      heap_sort_distp(hi - lo + 1, dp + lo);
+      return;
     }
-    else {
-      stat = node_add(vp, nd->lt, m, lt, alli, alln, user_data, callback);
-      if(stat == -1) {
-        return -1;
+
+    // Median of three
+    mid = lo + (hi - lo)/2;
+    if(dp[mid].d < dp[lo].d) {
+      swap_distp(dp, lo, mid);
+    }
+    if(dp[hi].d < dp[lo].d) {
+      swap_distp(dp, lo, hi);
+    }
+    if(dp[hi].d < dp[mid].d) {
+      swap_distp(dp, mid, hi);
+    }
+    pivot = dp[mid].d;
+
+    // Hoare partition: [lo, j] <= pivot <= [i, hi]
+    i = lo;
+    j = hi;
+    while(i <= j) {
+      while(dp[i].d < pivot) {
+        i++;
+      }
+      while(dp[j].d > pivot) {
+        j--;
+      }
+      if(i <= j) {
+        swap_distp(dp, i, j);
+        i++;
+        j--;
       }
     }
-  }
 
-  // Add ge nodes
-  ge = dp + m;
-  if(n - m > 0) {
-    if(nd->ge == NULL) {
-      nd->ge = node_create(vp, nd, n - m, ge, alli, alln, user_data, callback);
-      if(nd->ge == NULL) {
-        return -1;
-      }
+    if(k <= j) {
+      hi = j;
+    }
+    else if(k >= i) {
+      lo = i;
     }
     else {
-      stat = node_add(vp, nd->ge, n - m, ge, alli, alln, user_data, callback);
-      if(stat == -1) {
-        return -1;
-      }
+      return;
     }
   }
 
-  return 0;
+  insertion_sort_distp(hi - lo + 1, dp + lo);
 }
 
-
-int vptree_add_many_progress(
-  vptree *vp, int n, const void * const *p,
-  void *user_data, void (*callback)(void *user_data, int i, int n))
+/**
+ * Move all points closer than @c mu to the front of @c dp.
+ *
+ * @returns The number of points closer than @c mu
+ */
+static int partition_distp(int n, distp *dp, double mu)
 {
-  int i, alli;
-  distp *dp;
-  int stat;
+  int i, m;
 
-  stat = 0;
-  alli = 0;
+  for(i = m = 0; i < n; i++) {
+    if(dp[i].d < mu) {
+      swap_distp(dp, i, m);
+      m++;
+    }
+  }
 
+  return m;
+}
 
-  // Create distance-comparison structure
-  dp = allocate(vp, n * sizeof(distp));
-  for(i = 0; i < n; i++) {
-    dp[i].p = p[i];
+/**
+ * Median of the distances in @c dp.  Reorders @c dp.
+ */
+static double median_distp(int n, distp *dp)
+{
+  int i, m;
+  double lower;
+
+  m = n/2;
+  select_distp(n, dp, m);
+  if(n % 2 != 0) {
+    return dp[m].d;
   }
 
-  // Add to tree
-  if(vp->root == NULL) {
-    vp->root = node_create(vp, NULL, n, dp, &alli, n, user_data, callback);
-    if(vp->root == NULL) {
-      stat = -1;
+  // Even count: average with the largest distance below the middle
+  lower = dp[0].d;
+  for(i = 1; i < m; i++) {
+    if(dp[i].d > lower) {
+      lower = dp[i].d;
+    }
+  }
+
+  return (lower + dp[m].d)/2;
+}
+
+/**
+ * Boundaries splitting the distances in @c dp into @c m shells of equal
+ * size, the median for two shells.  Reorders @c dp.
+ */
+static void quantile_distp(int n, distp *dp, int m, double *mu)
+{
+  int i, j, q, lo;
+  double lower;
+
+  lo = 0;
+  for(i = 1; i < m; i++) {
+    q = (int)((long)i * n / m);
+    select_distp(n - lo, dp + lo, q - lo);
+    lo = q;
+
+    if((long)i * n % m != 0 || q == 0) {
+      mu[i-1] = dp[q].d;
+      continue;
+    }
+
+    // Boundary between two points: average with the largest distance below
+    lower = dp[0].d;
+    for(j = 1; j < q; j++) {
+      if(dp[j].d > lower) {
+        lower = dp[j].d;
+      }
+    }
+    mu[i-1] = (lower + dp[q].d)/2;
+  }
+}
+
+/**
+ * Set the distance from @c q of each of the @c n points in @c dp, passing
+ * them to distance_many in batches
+ *
+ * @returns -1 on failure of the distance function, otherwise 0
+ */
+static int distp_distances(const vptree *vp, const void *q, int n, distp *dp)
+{
+  const void *batch[DISTANCE_BATCH];
+  double d[DISTANCE_BATCH];
+  int i, j, m;
+
+  for(i = 0; i < n; i += m) {
+    m = (n - i < DISTANCE_BATCH) ? n - i : DISTANCE_BATCH;
+    for(j = 0; j < m; j++) {
+      batch[j] = dp[i + j].p;
+    }
+    distance_many(vp, q, m, batch, d);
+    for(j = 0; j < m; j++) {
+      dp[i + j].d = d[j];
+      if(d[j] < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Spread of distances from a candidate vantage point to a sample of the
+ * points: their second moment about the median.
+ *
+ * @returns The spread, or -1 on failure of the distance function
+ */
+static double vantage_spread(vptree *vp, const void *cand, int n, distp *dp, int s, uint64_t *rng)
+{
+  distp sample[VPTREE_MAX_VANTAGE_SAMPLES];
+  double mu, spread;
+  int i;
+
+  for(i = 0; i < s; i++) {
+    sample[i].p = dp[rng_uniform(rng, n)].p;
+  }
+  if(distp_distances(vp, cand, s, sample) == -1) {
+    return -1;
+  }
+
+  mu = median_distp(s, sample);
+
+  spread = 0;
+  for(i = 0; i < s; i++) {
+    spread += (sample[i].d - mu) * (sample[i].d - mu);
+  }
+
+  return spread / s;
+}
+
+/**
+ * Choose the vantage point for a new node from the @c n points in @c dp,
+ * according to the tree's selection method.
+ *
+ * @arg @c ref If non-NULL, the distances in @c dp are to @c ref->p
+ * @returns The index into @c dp of the selected point, or -1 on failure
+ */
+static int select_vantage(vptree *vp, const node *ref, int n, distp *dp, uint64_t *rng)
+{
+  int i, c, s, best;
+  double spread, best_spread;
+
+  switch(vp->opts.vantage) {
+  case VPTREE_VANTAGE_SPREAD:
+    s = vp->opts.vantage_samples;
+    if(s > VPTREE_MAX_VANTAGE_SAMPLES) {
+      s = VPTREE_MAX_VANTAGE_SAMPLES;
+    }
+    if(s > n) {
+      s = n;
+    }
+    if(s <= 1) {
+      break;
+    }
+
+    best = 0;
+    best_spread = -1;
+    for(i = 0; i < s; i++) {
+      c = rng_uniform(rng, n);
+      spread = vantage_spread(vp, dp[c].p, n, dp, s, rng);
+      if(spread < 0) {
+        return -1;
+      }
+      if(spread > best_spread) {
+        best = c;
+        best_spread = spread;
+      }
+    }
+    return best;
+
+  case VPTREE_VANTAGE_FARTHEST:
+    if(ref == NULL) {
+      break;
+    }
+
+    best = 0;
+    for(i = 1; i < n; i++) {
+      if(dp[i].d > dp[best].d) {
+        best = i;
+      }
+    }
+    return best;
+
+  default:
+    break;
+  }
+
+  return rng_uniform(rng, n);
+}
+
+/**
+ * Add @c n points to the subtree at @c *child, at depth @c depth, creating
+ * it if necessary.
+ */
+static int node_add_child(vptree *vp, node *parent, node **child, int n, distp *dp, build_ctx *build, uint64_t rng, int depth)
+{
+  if(n == 0) {
+    return 0;
+  }
+
+  if(*child == NULL) {
+    *child = node_create(vp, parent, n, dp, build, rng, depth);
+    if(*child == NULL) {
+      return -1;
     }
+    return 0;
   }
   else {
-    stat = node_add(vp, vp->root, n, dp, &alli, n, user_data, callback);
+    return node_add(vp, *child, n, dp, build, rng, depth);
   }
+}
 
-  deallocate(vp, dp);
+/**
+ * Store @c n more points in the bucket of leaf node @c nd, at depth @c depth
+ */
+static int bucket_add(vptree *vp, node *nd, int n, distp *dp, build_ctx *build, int depth)
+{
+  leaf *lf;
+  bucketp *b;
+  int i, h;
 
-  vp->n += n;
+  lf = node_leaf(vp, nd);
+  if(bucket_reserve(vp, lf, lf->nbucket + n) == -1) {
+    return -1;
+  }
+
+  if(distp_distances(vp, nd->p, n, dp) == -1) {
+    return -1;
+  }
+
+  h = vp->opts.pivot_history;
+  for(i = 0; i < n; i++) {
+    b = &lf->bucket[lf->nbucket];
+    b->p = dp[i].p;
+    b->d = dp[i].d;
+    if(b->d > nd->radius) {
+      nd->radius = b->d;
+    }
+    if(h > 0) {
+      hist_to_anc(h, &dp[i], depth, lf->anc + h * lf->nbucket);
+    }
+    lf->nbucket++;
+  }
+  nd->size += n;
+
+  build_progress(build, n);
+
+  return 0;
+}
+
+/**
+ * Turn full leaf @c nd, at depth @c depth, into an internal node, splitting
+ * its bucket together with @c n new points.
+ */
+static int bucket_split(vptree *vp, node *nd, int n, distp *dp, build_ctx *build, uint64_t rng, int depth)
+{
+  leaf *lf;
+  distp *all;
+  double *hist;
+  int i, h, stat;
+  build_ctx split;
+
+  h = vp->opts.pivot_history;
+  lf = node_leaf(vp, nd);
+  all = (distp *)allocate(vp, sizeof(distp) * (lf->nbucket + n));
+  if(all == NULL) {
+    return -1;
+  }
+  hist = NULL;
+  if(h > 0) {
+    hist = (double *)allocate(vp, sizeof(double) * h * lf->nbucket);
+    if(hist == NULL) {
+      deallocate(vp, all);
+      return -1;
+    }
+  }
+
+  // Bucket points carry their pivot history back into the build
+  for(i = 0; i < lf->nbucket; i++) {
+    all[i].p = lf->bucket[i].p;
+    all[i].hist = NULL;
+    if(h > 0) {
+      all[i].hist = hist + h * i;
+      anc_to_hist(h, lf->anc + h * i, depth, all[i].hist);
+    }
+  }
+  memcpy(all + lf->nbucket, dp, sizeof(distp) * n);
 
+  // The bucket points were counted when they were first added
+  build_progress(build, n);
+  split = *build;
+  split.callback = NULL;
+
+  n += lf->nbucket;
+  nd->size -= lf->nbucket;
+  bucket_release(vp, lf);
+
+  stat = node_add(vp, nd, n, all, &split, rng, depth);
+
+  if(hist != NULL) {
+    deallocate(vp, hist);
+  }
+  deallocate(vp, all);
   return stat;
 }
 
-int vptree_add_many(vptree *vp, int n, const void * const *p)
+/**
+ * Append every point in the subtree at @c nd to @c dp, except tombstones
+ */
+static void node_collect(const vptree *vp, const node *nd, distp *dp, int *n)
 {
-  return vptree_add_many_progress(vp, n, p, NULL, NULL);
+  const leaf *lf;
+  node **child;
+  int i;
+
+  if(nd == NULL) {
+    return;
+  }
+
+  if(!nd->deleted) {
+    dp[(*n)++].p = nd->p;
+  }
+
+  if(is_leaf(nd)) {
+    lf = node_leaf(vp, nd);
+    for(i = 0; i < lf->nbucket; i++) {
+      dp[(*n)++].p = lf->bucket[i].p;
+    }
+    return;
+  }
+
+  child = node_child(vp, nd);
+  for(i = 0; i < vp->opts.arity; i++) {
+    node_collect(vp, child[i], dp, n);
+  }
+}
+
+/**
+ * The number of points at the front of @c dp, partitioned by the split of
+ * @c nd, that go below child @c i.
+ */
+static int child_count(const vptree *vp, const node *nd, int i, int n, const distp *dp)
+{
+  int m;
+
+  if(i == vp->opts.arity - 1) {
+    return n;
+  }
+
+  for(m = 0; m < n && dp[m].d < nd->mu[i]; m++) {
+  }
+
+  return m;
+}
+
+/**
+ * Check whether adding the @c n points in @c dp, partitioned by the split of
+ * @c nd, would leave one child with too large a share of the subtree.
+ */
+static bool node_unbalanced(const vptree *vp, const node *nd, int n, const distp *dp)
+{
+  double alpha, lo, hi;
+  node **child;
+  int i, m, c, arity, size, total;
+
+  alpha = vp->opts.rebalance_alpha;
+  if(alpha <= 0) {
+    return false;
+  }
+
+  arity = vp->opts.arity;
+  child = node_child(vp, nd);
+  total = 1 + n;
+  for(i = 0; i < arity; i++) {
+    total += (child[i] == NULL ? 0 : child[i]->size);
+  }
+
+  // Small subtrees are not worth rebuilding
+  if(total <= arity * vp->opts.leaf_size + 2) {
+    return false;
+  }
+
+  // A wider node allows each child a smaller share, as for the subtrees
+  // log2(arity) levels down a binary tree
+  if(arity > 2) {
+    alpha = pow(alpha, log2(arity));
+  }
+
+  // A shell whose points are all at one distance from the vantage point, as
+  // with duplicates or integer metrics, ends up whole in one shell of any
+  // split from it, so rebuilding cannot balance it
+  for(i = m = 0; i < arity; m += c, i++) {
+    c = child_count(vp, nd, i, n - m, dp + m);
+    size = c + (child[i] == NULL ? 0 : child[i]->size);
+    child_range(vp, nd, i, &lo, &hi);
+    if(size > alpha * total && lo < hi) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Rebuild the subtree at @c nd, at depth @c depth, from scratch, with a fresh
+ * vantage point and median split at every level, including @c n new points.
+ * Tombstones are dropped.
+ *
+ * @returns The number of tombstones dropped, or -1 on failure
+ */
+static int node_rebuild(vptree *vp, node *nd, int n, distp *dp, build_ctx *build, uint64_t rng, int depth)
+{
+  distp *all;
+  double *hist;
+  const node *anc;
+  node **child;
+  int i, j, h, total, dropped, stat;
+  build_ctx rebuild;
+
+  h = vp->opts.pivot_history;
+  all = (distp *)allocate(vp, sizeof(distp) * (nd->size + n));
+  if(all == NULL) {
+    return -1;
+  }
+
+  total = 0;
+  node_collect(vp, nd, all, &total);
+
+  // The collected points only kept their distances to their own ancestors
+  // within the subtree; recompute those to the ancestors above it
+  hist = NULL;
+  if(h > 0 && total > 0) {
+    hist = (double *)allocate(vp, sizeof(double) * h * total);
+    if(hist == NULL) {
+      deallocate(vp, all);
+      return -1;
+    }
+  }
+  for(i = 0; i < total; i++) {
+    all[i].hist = NULL;
+    if(h == 0) {
+      continue;
+    }
+
+    all[i].hist = hist + h * i;
+    for(j = 0, anc = nd->parent; j < h && anc != NULL; j++, anc = anc->parent) {
+      all[i].hist[(depth - 1 - j) % h] = distance(vp, anc->p, all[i].p);
+      if(all[i].hist[(depth - 1 - j) % h] < 0) {
+        deallocate(vp, hist);
+        deallocate(vp, all);
+        return -1;
+      }
+    }
+  }
+
+  if(n > 0) {
+    memcpy(all + total, dp, sizeof(distp) * n);
+    total += n;
+  }
+  dropped = nd->ndeleted;
+
+  if(is_leaf(nd)) {
+    bucket_release(vp, node_leaf(vp, nd));
+  }
+  else {
+    child = node_child(vp, nd);
+    for(i = 0; i < vp->opts.arity; i++) {
+      node_destroy(vp, child[i]);
+    }
+  }
+
+  // Only the new points count towards progress
+  build_progress(build, n);
+  rebuild = *build;
+  rebuild.callback = NULL;
+
+  stat = node_build(vp, nd, NULL, total, all, &rebuild, rng, depth);
+
+  if(hist != NULL) {
+    deallocate(vp, hist);
+  }
+  deallocate(vp, all);
+  return (stat == -1) ? -1 : dropped;
+}
+
+/**
+ * Add @c n points to the subtree at @c nd.
+ *
+ * @returns The number of tombstones dropped from the subtree by rebuilds,
+ *          or -1 on failure
+ */
+static int node_add(vptree *vp, node *nd, int n, distp *dp, build_ctx *build, uint64_t rng, int depth)
+{
+  int i, j, h, m, c, arity, stat, dropped;
+  uint64_t child_rng;
+  double *bound;
+  node **child;
+  leaf *lf;
+  bool failed, split;
+
+  // Leaf nodes keep up to leaf_size points
+  if(is_leaf(nd)) {
+    lf = node_leaf(vp, nd);
+    if(lf->nbucket + n < vp->opts.leaf_size) {
+      return bucket_add(vp, nd, n, dp, build, depth);
+    }
+    else if(lf->nbucket > 0) {
+      return bucket_split(vp, nd, n, dp, build, rng, depth);
+    }
+  }
+
+  // Calculate distances.  Serial builds stay clear of OpenMP, whose task
+  // bookkeeping would cost time and stack at every level.
+  failed = false;
+  if(build->parallel && n >= PARALLEL_CUTOFF) {
+    #pragma omp taskloop default(shared) grainsize(PARALLEL_CUTOFF/4/DISTANCE_BATCH)
+    for(i = 0; i < n; i += DISTANCE_BATCH) {
+      if(distp_distances(vp, nd->p, (n - i < DISTANCE_BATCH) ? n - i : DISTANCE_BATCH, dp + i) == -1) {
+        #pragma omp atomic write
+        failed = true;
+      }
+    }
+  }
+  else if(distp_distances(vp, nd->p, n, dp) == -1) {
+    failed = true;
+  }
+  if(failed) {
+    return -1;
+  }
+  for(i = 0; i < n; i++) {
+    if(dp[i].d > nd->radius) {
+      nd->radius = dp[i].d;
+    }
+  }
+
+  // Previously a leaf node, find the shell boundaries.  The bounds take
+  // the place of the emptied bucket, which may still hold storage.
+  arity = vp->opts.arity;
+  bound = node_bound(vp, nd);
+  child = node_child(vp, nd);
+  split = !is_leaf(nd);
+  if(!split) {
+    bucket_release(vp, node_leaf(vp, nd));
+    quantile_distp(n, dp, arity, nd->mu);
+    for(i = 0; i < arity; i++) {
+      bound[2*i] = INFINITY;
+      bound[2*i + 1] = -INFINITY;
+    }
+  }
+
+  for(i = m = 0; i < arity - 1; i++) {
+    m += partition_distp(n - m, dp + m, nd->mu[i]);
+  }
+
+  // Widen each child's range of distances to take its new points
+  for(i = m = 0; i < arity; m += c, i++) {
+    c = child_count(vp, nd, i, n - m, dp + m);
+    for(j = m; j < m + c; j++) {
+      if(dp[j].d < bound[2*i]) {
+        bound[2*i] = dp[j].d;
+      }
+      if(dp[j].d > bound[2*i + 1]) {
+        bound[2*i + 1] = dp[j].d;
+      }
+    }
+  }
+
+  // Scapegoat rebalancing: an existing split that would become lopsided is
+  // rebuilt, rather than letting insertions grow long chains.  A subtree
+  // must have grown since it was last built, so repeated rebuilds cost
+  // amortized O(log n) per insertion.
+  if(split && nd->size + n >= nd->rebuild_size && node_unbalanced(vp, nd, n, dp)) {
+    return node_rebuild(vp, nd, n, dp, build, rng, depth);
+  }
+  nd->size += n;
+
+  // Keep the distances in each point's pivot history
+  h = vp->opts.pivot_history;
+  if(h > 0) {
+    for(i = 0; i < n; i++) {
+      dp[i].hist[depth % h] = dp[i].d;
+    }
+  }
+
+  // TODO: case with equal distances
+  // In parallel builds each subtree but the last is a separate task, which
+  // idle threads may steal, while this thread continues with the last.
+  dropped = 0;
+  for(i = m = 0; i < arity; m += c, i++) {
+    c = child_count(vp, nd, i, n - m, dp + m);
+    child_rng = rng_next(&rng);
+    if(!build->parallel) {
+      stat = node_add_child(vp, nd, &child[i], c, dp + m, build, child_rng, depth + 1);
+      if(stat == -1) {
+        failed = true;
+      }
+      else {
+        dropped += stat;
+      }
+      continue;
+    }
+
+    #pragma omp task default(shared) firstprivate(i, m, c, child_rng) private(stat) if(c >= PARALLEL_CUTOFF && i < arity - 1)
+    {
+      stat = node_add_child(vp, nd, &child[i], c, dp + m, build, child_rng, depth + 1);
+      if(stat == -1) {
+        #pragma omp atomic write
+        failed = true;
+      }
+      else {
+        #pragma omp atomic
+        dropped += stat;
+      }
+    }
+  }
+
+  if(build->parallel) {
+    #pragma omp taskwait
+  }
+  if(failed) {
+    return -1;
+  }
+
+  nd->size -= dropped;
+  nd->ndeleted -= dropped;
+
+  return dropped;
+}
+
+int vptree_add_many_progress(
+  vptree *vp, int n, const void * const *p,
+  void *user_data, void (*callback)(void *user_data, int i, int n))
+{
+  int i, h, nthreads;
+  distp *dp;
+  double *hist;
+  int stat;
+  build_ctx build;
+  uint64_t rng;
+
+  // Frozen trees are immutable
+  if(vp->frozen != NULL) {
+    return -1;
+  }
+
+  stat = 0;
+
+  build.parallel = false;
+  build.i = 0;
+  build.n = n;
+  build.user_data = user_data;
+  build.callback = callback;
+
+  rng = rng_next(&vp->rng);
+
+  // Create distance-comparison structure
+  h = vp->opts.pivot_history;
+  dp = allocate(vp, n * sizeof(distp));
+  hist = (h > 0) ? (double *)allocate(vp, sizeof(double) * h * n) : NULL;
+  for(i = 0; i < n; i++) {
+    dp[i].p = p[i];
+    dp[i].hist = (h > 0) ? hist + h * i : NULL;
+  }
+
+  // Add to tree
+  nthreads = 1;
+#ifdef _OPENMP
+  if(vp->opts.num_threads > 1 && n >= PARALLEL_CUTOFF) {
+    build.parallel = true;
+    nthreads = vp->opts.num_threads;
+  }
+#endif
+
+  #pragma omp parallel num_threads(nthreads) if(build.parallel)
+  #pragma omp single
+  {
+    if(vp->root == NULL) {
+      vp->root = node_create(vp, NULL, n, dp, &build, rng, 0);
+      if(vp->root == NULL) {
+        stat = -1;
+      }
+    }
+    else {
+      stat = node_add(vp, vp->root, n, dp, &build, rng, 0);
+    }
+  }
+
+  if(hist != NULL) {
+    deallocate(vp, hist);
+  }
+  deallocate(vp, dp);
+
+  vp->n += n;
+
+  return (stat == -1) ? -1 : 0;
+}
+
+int vptree_add_many(vptree *vp, int n, const void * const *p)
+{
+  return vptree_add_many_progress(vp, n, p, NULL, NULL);
+}
+
+int vptree_add(vptree *vp, const void *p)
+{
+  return vptree_add_many(vp, 1, &p);
+}
+
+///////////////////////////// vp-tree Removal /////////////////////////
+
+static int node_depth(const node *nd)
+{
+  int depth;
+
+  for(depth = 0; nd->parent != NULL; nd = nd->parent) {
+    depth++;
+  }
+
+  return depth;
+}
+
+static bool too_many_deleted(const node *nd, double ratio)
+{
+  return nd->ndeleted > 0 && nd->ndeleted > ratio * nd->size;
+}
+
+/**
+ * Rebuild the subtree at @c *ndp from its remaining points, or remove it if
+ * none remain.
+ *
+ * @returns The number of tombstones dropped, or -1 on failure
+ */
+static int node_purge(vptree *vp, node **ndp)
+{
+  node *nd;
+  int dropped;
+  build_ctx build;
+
+  nd = *ndp;
+  if(nd->ndeleted == nd->size) {
+    dropped = nd->ndeleted;
+    node_destroy(vp, nd);
+    *ndp = NULL;
+    return dropped;
+  }
+
+  build.parallel = false;
+  build.i = build.n = 0;
+  build.user_data = NULL;
+  build.callback = NULL;
+
+  return node_rebuild(vp, nd, 0, NULL, &build, rng_next(&vp->rng), node_depth(nd));
+}
+
+/**
+ * Location of the pointer to @c nd in its parent, or the tree root
+ */
+static node **node_slot(vptree *vp, node *nd)
+{
+  node **child;
+  int i;
+
+  if(nd->parent == NULL) {
+    return &vp->root;
+  }
+
+  child = node_child(vp, nd->parent);
+  for(i = 0; child[i] != nd; i++);
+
+  return &child[i];
+}
+
+int vptree_remove(vptree *vp, const void *p)
+{
+  node *nd, *found, *anc, *top;
+  leaf *lf;
+  double d;
+  int i, h, dropped;
+
+  // Follow the path p was inserted along
+  found = NULL;
+  nd = vp->root;
+  while(nd != NULL) {
+    if(nd->p == p && !nd->deleted) {
+      // Leave a tombstone in place of the vantage point
+      nd->deleted = true;
+      for(anc = nd; anc != NULL; anc = anc->parent) {
+        anc->ndeleted++;
+      }
+      found = nd;
+      break;
+    }
+
+    if(is_leaf(nd)) {
+      lf = node_leaf(vp, nd);
+      for(i = 0; i < lf->nbucket && lf->bucket[i].p != p; i++);
+
+      if(i < lf->nbucket) {
+        h = vp->opts.pivot_history;
+        lf->bucket[i] = lf->bucket[--lf->nbucket];
+        if(h > 0) {
+          memcpy(lf->anc + h * i, lf->anc + h * lf->nbucket,
+                 sizeof(double) * h);
+        }
+        for(anc = nd; anc != NULL; anc = anc->parent) {
+          anc->size--;
+        }
+        found = nd;
+      }
+      break;
+    }
+
+    d = distance(vp, nd->p, p);
+    if(d < 0) {
+      return -1;
+    }
+    nd = node_child(vp, nd)[shell_index(vp, nd, d)];
+  }
+
+  if(found == NULL) {
+    return -1;
+  }
+  vp->n--;
+
+  if(vp->frozen != NULL || vp->opts.compact_ratio <= 0) {
+    return 0;
+  }
+
+  // Compact the highest subtree on the path with too many tombstones
+  top = NULL;
+  for(anc = found; anc != NULL; anc = anc->parent) {
+    if(too_many_deleted(anc, vp->opts.compact_ratio)) {
+      top = anc;
+    }
+  }
+  if(top == NULL) {
+    return 0;
+  }
+
+  anc = top->parent;
+  dropped = node_purge(vp, node_slot(vp, top));
+  if(dropped == -1) {
+    return -1;
+  }
+  for(; anc != NULL; anc = anc->parent) {
+    anc->size -= dropped;
+    anc->ndeleted -= dropped;
+  }
+
+  return 0;
+}
+
+/**
+ * @returns The number of tombstones dropped, or -1 on failure
+ */
+static int node_compact(vptree *vp, node **ndp, double ratio)
+{
+  node *nd, **child;
+  int i, stat, dropped;
+
+  nd = *ndp;
+  if(nd == NULL || nd->ndeleted == 0) {
+    return 0;
+  }
+
+  if(too_many_deleted(nd, ratio)) {
+    return node_purge(vp, ndp);
+  }
+
+  // Leaves have no children to compact
+  if(is_leaf(nd)) {
+    return 0;
+  }
+
+  child = node_child(vp, nd);
+  dropped = 0;
+  for(i = 0; i < vp->opts.arity; i++) {
+    stat = node_compact(vp, &child[i], ratio);
+    if(stat == -1) {
+      return -1;
+    }
+    dropped += stat;
+  }
+
+  nd->size -= dropped;
+  nd->ndeleted -= dropped;
+
+  return dropped;
+}
+
+int vptree_compact(vptree *vp, double ratio)
+{
+  if(vp->frozen != NULL) {
+    return -1;
+  }
+
+  return (node_compact(vp, &vp->root, ratio) == -1) ? -1 : 0;
+}
+
+///////////////////////////// Frozen Layout ///////////////////////////
+
+/**
+ * Count the nodes and bucket points in the subtree at @c nd.
+ *
+ * @returns The height of the subtree
+ */
+static int node_count(const vptree *vp, const node *nd, int *nnodes, int *nbucket)
+{
+  node **child;
+  int i, height, child_height;
+
+  if(nd == NULL) {
+    return 0;
+  }
+
+  (*nnodes)++;
+  if(is_leaf(nd)) {
+    *nbucket += node_leaf(vp, nd)->nbucket;
+    return 1;
+  }
+
+  child = node_child(vp, nd);
+  height = 0;
+  for(i = 0; i < vp->opts.arity; i++) {
+    child_height = node_count(vp, child[i], nnodes, nbucket);
+    if(child_height > height) {
+      height = child_height;
+    }
+  }
+
+  return 1 + height;
+}
+
+static void veb_order(const vptree *vp, node *nd, int height, node **order, int *n);
+
+/**
+ * Append the van Emde Boas order of each subtree rooted @c depth levels
+ * below @c nd, truncated to @c height levels.
+ */
+static void veb_bottom(const vptree *vp, node *nd, int depth, int height, node **order, int *n)
+{
+  node **child;
+  int i;
+
+  if(nd == NULL) {
+    return;
+  }
+
+  if(depth == 0) {
+    veb_order(vp, nd, height, order, n);
+  }
+  else if(!is_leaf(nd)) {
+    child = node_child(vp, nd);
+    for(i = 0; i < vp->opts.arity; i++) {
+      veb_bottom(vp, child[i], depth - 1, height, order, n);
+    }
+  }
+}
+
+/**
+ * Append the nodes in the top @c height levels of the subtree at @c nd in
+ * van Emde Boas order: the top half of the levels, recursively laid out,
+ * followed by each subtree hanging below them.
+ */
+static void veb_order(const vptree *vp, node *nd, int height, node **order, int *n)
+{
+  int top;
+
+  if(nd == NULL) {
+    return;
+  }
+
+  if(height == 1) {
+    order[(*n)++] = nd;
+    return;
+  }
+
+  top = height / 2;
+  veb_order(vp, nd, top, order, n);
+  veb_bottom(vp, nd, top, height - top, order, n);
+}
+
+static node *forward(const node *nd)
+{
+  return (nd == NULL) ? NULL : nd->parent;
+}
+
+int vptree_freeze(vptree *vp)
+{
+  int i, j, h, height, nnodes, nbucket;
+  size_t stride;
+  node **order, *nd, **child;
+  leaf *lf;
+  bucketp *buckets;
+  double *bucket_anc;
+  char *nodes;
+  void *block;
+
+  if(vp->frozen != NULL || vp->root == NULL) {
+    return 0;
+  }
+
+  nnodes = nbucket = 0;
+  height = node_count(vp, vp->root, &nnodes, &nbucket);
+
+  h = vp->opts.pivot_history;
+  stride = node_bytes(vp);
+  block = allocate(vp, stride * nnodes + (sizeof(bucketp) + sizeof(double) * h) * nbucket);
+  if(block == NULL) {
+    return -1;
+  }
+  order = (node **)allocate(vp, sizeof(node *) * nnodes);
+  if(order == NULL) {
+    deallocate(vp, block);
+    return -1;
+  }
+
+  i = 0;
+  veb_order(vp, vp->root, height, order, &i);
+  assert(i == nnodes);
+
+  // Copy nodes, with their arrays, and buckets into the block, in layout
+  // order
+  nodes = (char *)block;
+  buckets = (bucketp *)(nodes + stride * nnodes);
+  bucket_anc = (double *)(buckets + nbucket);
+  for(i = 0; i < nnodes; i++) {
+    nd = (node *)(nodes + stride * i);
+    memcpy(nd, order[i], stride);
+    if(!is_leaf(nd)) {
+      continue;
+    }
+
+    lf = node_leaf(vp, nd);
+    lf->bucket = NULL;
+    lf->anc = NULL;
+    if(lf->nbucket > 0) {
+      memcpy(buckets, node_leaf(vp, order[i])->bucket, sizeof(bucketp) * lf->nbucket);
+      lf->bucket = buckets;
+      buckets += lf->nbucket;
+
+      if(h > 0) {
+        memcpy(bucket_anc, node_leaf(vp, order[i])->anc, sizeof(double) * h * lf->nbucket);
+        lf->anc = bucket_anc;
+        bucket_anc += h * lf->nbucket;
+      }
+    }
+  }
+
+  // The old nodes' parent links are no longer needed; use them to hold
+  // each node's new address while relinking the copies.
+  for(i = 0; i < nnodes; i++) {
+    order[i]->parent = (node *)(nodes + stride * i);
+  }
+  for(i = 0; i < nnodes; i++) {
+    nd = (node *)(nodes + stride * i);
+    nd->parent = forward(nd->parent);
+    child = node_child(vp, nd);
+    for(j = 0; j < vp->opts.arity; j++) {
+      child[j] = forward(child[j]);
+    }
+  }
+
+  if(vp->opts.slab_size == 0) {
+    node_destroy(vp, vp->root);
+  }
+  else {
+    arena_destroy(&vp->arena);
+    init_node_memory(vp);
+  }
+  deallocate(vp, order);
+
+  vp->root = (node *)nodes;
+  vp->frozen = block;
+
+  return 0;
+}
+
+//////////////////////////////// Pivot Filtering //////////////////////////
+
+/**
+ * Searches keep the query's distances to the vantage points on the path down
+ * to this depth, to combine with the tree's pivot history
+ */
+#define PIVOT_MAX_DEPTH (256)
+
+/**
+ * Bounds from the triangle inequality on the distance from the query to a
+ * point, given the point's pivot history @c anc for a node at depth
+ * @c depth, and the query's distances @c qd to the vantage points above it
+ * (indexed by depth, -1 where not computed).
+ */
+static void pivot_bounds(int h, const double *anc, const double *qd, int depth,
+                         double *lo, double *hi)
+{
+  int j, a;
+
+  *lo = 0;
+  *hi = INFINITY;
+  for(j = 0; j < h && j < depth; j++) {
+    a = depth - 1 - j;
+    if(a >= PIVOT_MAX_DEPTH || qd[a] < 0 || anc[j] < 0) {
+      continue;
+    }
+
+    if(fabs(qd[a] - anc[j]) > *lo) {
+      *lo = fabs(qd[a] - anc[j]);
+    }
+    if(qd[a] + anc[j] < *hi) {
+      *hi = qd[a] + anc[j];
+    }
+  }
+}
+
+/**
+ * Check whether bounds [@c lo, @c hi] on the distance to the vantage point
+ * of a node already decide everything its exact distance would in a search
+ * of radius @c r: that the point is out of range, and which children to
+ * visit.  Leaves with a bucket always take the distance, to filter the
+ * bucket with.
+ */
+static bool pivot_settles(const vptree *vp, const node *nd, double lo, double hi, double r)
+{
+  double slo, shi;
+  int i;
+
+  if(lo < r) {
+    return false;
+  }
+
+  if(is_leaf(nd)) {
+    return node_leaf(vp, nd)->nbucket == 0;
+  }
+
+  // A child is visited at distances in (slo - r, shi + r)
+  for(i = 0; i < vp->opts.arity; i++) {
+    child_range(vp, nd, i, &slo, &shi);
+    if(!(hi <= slo - r || lo >= shi + r || (lo > slo - r && hi < shi + r))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/////////////////////////////// Query Context /////////////////////////////
+
+static void query_ctx_init(vptree_query_ctx *ctx, const vptree *vp)
+{
+  memset(ctx, 0, sizeof(vptree_query_ctx));
+  ctx->vp = vp;
+}
+
+static void query_ctx_release(vptree_query_ctx *ctx)
+{
+  const vptree *vp = ctx->vp;
+
+  if(ctx->nndist != NULL) {
+    deallocate(vp, ctx->nndist);
+  }
+  if(ctx->stack != NULL) {
+    deallocate(vp, ctx->stack);
+  }
+  if(ctx->pnodes != NULL) {
+    deallocate(vp, ctx->pnodes);
+  }
+  if(ctx->pq != NULL) {
+    pqueue_free(ctx->pq);
+  }
+}
+
+/**
+ * Make room for the distances to @c k neighbors.
+ *
+ * @returns The distance array, or NULL on failure
+ */
+static double *query_ctx_nndist(vptree_query_ctx *ctx, int k)
+{
+  if(ctx->nndist_size < k) {
+    if(ctx->nndist != NULL) {
+      deallocate(ctx->vp, ctx->nndist);
+    }
+    ctx->nndist = (double *)allocate(ctx->vp, sizeof(double) * k);
+    ctx->nndist_size = (ctx->nndist != NULL) ? k : 0;
+  }
+
+  return ctx->nndist;
+}
+
+vptree_query_ctx *vptree_query_ctx_create(const vptree *vp)
+{
+  vptree_query_ctx *ctx;
+
+  ctx = (vptree_query_ctx *)allocate(vp, sizeof(vptree_query_ctx));
+  if(ctx == NULL) {
+    return NULL;
+  }
+  query_ctx_init(ctx, vp);
+
+  return ctx;
+}
+
+void vptree_query_ctx_destroy(vptree_query_ctx *ctx)
+{
+  if(ctx == NULL) {
+    return;
+  }
+
+  query_ctx_release(ctx);
+  deallocate(ctx->vp, ctx);
+}
+
+//////////////////////////////// k-NN Query ////////////////////////////
+
+/**
+ * From this many neighbors on, the result set is kept as a heap rather than
+ * a sorted array
+ */
+#define KNN_HEAP_CUTOFF (128)
+
+/**
+ * Move the entry at heap position @c i down to its place in a max-heap of
+ * @c n entries. Heap position @c i is stored at index @c k-1-i, so that the
+ * largest distance is always at @c nndist[k-1].
+ */
+static void knn_sift_down(int k, int n, const void **nn, double *nndist, int i)
+{
+  const void *ndp;
+  double d;
+  int c;
+
+  ndp = nn[k-1-i];
+  d = nndist[k-1-i];
+  for(c = 2*i + 1; c < n; i = c, c = 2*i + 1) {
+    if(c + 1 < n && nndist[k-2-c] > nndist[k-1-c]) {
+      c++;
+    }
+    if(nndist[k-1-c] <= d) {
+      break;
+    }
+    nn[k-1-i] = nn[k-1-c];
+    nndist[k-1-i] = nndist[k-1-c];
+  }
+  nn[k-1-i] = ndp;
+  nndist[k-1-i] = d;
+}
+
+/**
+ * Add @c ndp at distance @c d from the query point to the nearest neighbors.
+ *
+ * For fewer than KNN_HEAP_CUTOFF neighbors, will maintain the neighbor list
+ * in ascending order of distance from the query point. Otherwise the list
+ * is a max-heap, put in order by knn_finish(). Either way @c nndist[k-1]
+ * is the distance to the furthest neighbor.
+ *
+ * @note If @c d is greater than the distance from the furthest of the @c k
+ *       existing neighbors, this is a noop.
+ */
+static void add_knn(int k, const void **nn, double *nndist, const void *ndp, double d)
+{
+  int i, j;
+
+  assert(k >= 1);
+
+  if(d >= nndist[k-1]) {
+    return;
+  }
+
+  // Replace the furthest neighbor and restore the heap
+  if(k >= KNN_HEAP_CUTOFF) {
+    nn[k-1] = ndp;
+    nndist[k-1] = d;
+    knn_sift_down(k, k, nn, nndist, 0);
+    return;
+  }
+  
+  for(i = 0; i < k && nndist[i] < d; i++);
+  for(j = k-1; j > i; j--) {
+    nn[j] = nn[j-1];
+    nndist[j] = nndist[j-1];
+  }
+  nn[i] = ndp;
+  nndist[i] = d;
+}
+
+/**
+ * Put the neighbors found with add_knn() in ascending order of distance
+ */
+static void knn_finish(int k, const void **nn, double *nndist)
+{
+  const void *ndp;
+  double d;
+  int n, i;
+
+  if(k < KNN_HEAP_CUTOFF) {
+    return;
+  }
+
+  // Heapsort: the largest goes to the last heap position, i.e. the front
+  for(n = k - 1; n > 0; n--) {
+    ndp = nn[k-1];
+    d = nndist[k-1];
+    nn[k-1] = nn[k-1-n];
+    nndist[k-1] = nndist[k-1-n];
+    nn[k-1-n] = ndp;
+    nndist[k-1-n] = d;
+    knn_sift_down(k, n, nn, nndist, 0);
+  }
+
+  // That leaves them in descending order
+  for(i = 0; i < k/2; i++) {
+    ndp = nn[i];
+    nn[i] = nn[k-1-i];
+    nn[k-1-i] = ndp;
+    d = nndist[i];
+    nndist[i] = nndist[k-1-i];
+    nndist[k-1-i] = d;
+  }
+}
+
+/**
+ * Add @c n points to the nearest neighbors, with one call to distance_many
+ */
+static void knn_add_batch(
+  const vptree *vp, const void *p, int k,
+  const void **nn, double *nndist,
+  int n, const void * const *batch)
+{
+  double d[DISTANCE_BATCH];
+  int i;
+
+  distance_many(vp, p, n, batch, d);
+  for(i = 0; i < n; i++) {
+    add_knn(k, nn, nndist, batch[i], d[i]);
+  }
+}
+
+/**
+ * Add the points in the bucket of leaf @c nd, at distance @c d from the
+ * query (-1 if not computed), to the nearest neighbors.
+ *
+ * @arg @c qd, @c depth The query's distances to the vantage points above
+ *      @c nd, or NULL to not use the pivot history
+ */
+static void bucket_knn(
+  const vptree *vp, const node *nd,
+  const void *p, double d, int k,
+  const void **nn, double *nndist,
+  const double *qd, int depth)
+{
+  const leaf *lf;
+  const bucketp *b;
+  const void *batch[DISTANCE_BATCH];
+  double lo, hi;
+  int i, h, nbatch;
+
+  h = vp->opts.pivot_history;
+  lf = node_leaf(vp, nd);
+  nbatch = 0;
+  for(i = 0, b = lf->bucket; i < lf->nbucket; i++, b++) {
+    // Triangle inequality: |d - b->d| is a lower bound on the distance
+    if(d >= 0 && fabs(d - b->d) >= nndist[k-1]) {
+      continue;
+    }
+    if(qd != NULL) {
+      pivot_bounds(h, lf->anc + h * i, qd, depth, &lo, &hi);
+      if(lo >= nndist[k-1]) {
+        continue;
+      }
+    }
+
+    if(vp->opts.distance_many == NULL) {
+      add_knn(k, nn, nndist, b->p, distance_bounded(vp, p, b->p, nndist[k-1]));
+      continue;
+    }
+
+    // Points that pass the filters go to distance_many together
+    batch[nbatch++] = b->p;
+    if(nbatch == DISTANCE_BATCH) {
+      knn_add_batch(vp, p, k, nn, nndist, nbatch, batch);
+      nbatch = 0;
+    }
+  }
+  if(nbatch > 0) {
+    knn_add_batch(vp, p, k, nn, nndist, nbatch, batch);
+  }
+}
+
+/**
+ * Searches start with room for this many pending subtrees on the C stack
+ */
+#define NN_STACK_SIZE (128)
+
+/**
+ * Searches with a deadline read the clock once per this many nodes
+ */
+#define DEADLINE_CHECK_NODES (16)
+
+/**
+ * Nanoseconds on a monotonic clock
+ */
+static long long clock_ns(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (long long)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Push the children of @c nd whose shells come within @c r of the query,
+ * with bounds from the query's distance to @c nd->p lying in [@c lo, @c hi].
+ * They are ordered so the nearest shell is popped first.
+ *
+ * @returns The new top of the stack
+ */
+static int push_children(const vptree *vp, const node *nd, double lo, double hi, double r,
+                         int depth, nnentry *stack, int top)
+{
+  double slo, shi, lb;
+  node **child;
+  nnentry tmp;
+  int i, j, base;
+
+  child = node_child(vp, nd);
+  base = top;
+  for(i = 0; i < vp->opts.arity; i++) {
+    if(child[i] == NULL) {
+      continue;
+    }
+
+    child_range(vp, nd, i, &slo, &shi);
+    lb = 0;
+    if(slo - hi > lb) {
+      lb = slo - hi;
+    }
+    if(lo - shi > lb) {
+      lb = lo - shi;
+    }
+    if(lb >= r) {
+      continue;
+    }
+
+    // Insert by descending bound; among equal bounds the later shell, which
+    // holds the query's distance, ends up on top
+    tmp.nd = child[i];
+    tmp.lb = lb;
+    tmp.depth = depth + 1;
+    for(j = top; j > base && stack[j-1].lb < lb; j--) {
+      stack[j] = stack[j-1];
+    }
+    stack[j] = tmp;
+    top++;
+  }
+
+  return top;
+}
+
+/**
+ * Exact k-NN search, depth first from an explicit stack, nearest shell
+ * first.
+ *
+ * @arg @c qd The query's distances to the vantage points on the current
+ *      path, indexed by depth, or NULL to not use the pivot history
+ * @arg @c ctx Keeps the stack if it outgrows the C stack, for later queries
+ * @arg @c scale Subtrees are skipped unless they could hold a point closer
+ *      than @c scale times the current k-th distance; 1 for an exact search
+ * @arg @c skipped Output, the smallest lower bound of any subtree skipped
+ *      only because of @c scale, or INFINITY.  0 if the deadline cut the
+ *      search short.
+ * @arg @c deadline Time on clock_ns() to give up at, or NULL for none
+ * @returns 0 on success, -1 if the stack could not grow, which leaves the
+ *          neighbors found so far
+ */
+static int nn_query(
+  vptree_query_ctx *ctx, node *root,
+  const void *p, int k,
+  const void **nn, double *nndist,
+  double *qd, double scale, double *skipped, const long long *deadline)
+{
+  const vptree *vp = ctx->vp;
+  nnentry local[NN_STACK_SIZE], *stack, *grown, e;
+  int top, size, grow, visited, ret;
+  node *nd;
+  double d, lo, hi;
+
+  assert(k >= 1);
+
+  *skipped = INFINITY;
+  if(root == NULL) {
+    return 0;
+  }
+
+  stack = local;
+  size = NN_STACK_SIZE;
+  if(ctx->stack != NULL) {
+    stack = ctx->stack;
+    size = ctx->stack_size;
+  }
+  stack[0].nd = root;
+  stack[0].lb = 0;
+  stack[0].depth = 0;
+  top = 1;
+  visited = 0;
+  ret = 0;
+
+  while(top > 0) {
+    e = stack[--top];
+    nd = e.nd;
+
+    // The radius may have shrunk since the subtree was pushed
+    if(e.lb >= scale * nndist[k-1]) {
+      if(e.lb < nndist[k-1] && e.lb < *skipped) {
+        *skipped = e.lb;
+      }
+      continue;
+    }
+
+    // Out of time, keep what has been found so far
+    if(deadline != NULL && ++visited % DEADLINE_CHECK_NODES == 0 &&
+       clock_ns() >= *deadline) {
+      *skipped = 0;
+      break;
+    }
+
+    // Bounds on the distance to the current node, from the pivot history
+    lo = 0;
+    hi = INFINITY;
+    if(qd != NULL) {
+      pivot_bounds(vp->opts.pivot_history, node_anc(vp, nd), qd, e.depth, &lo, &hi);
+    }
+
+    // Calculate distance to current node, unless the bounds settle it.
+    // Beyond the covering radius plus the k-th distance, the whole subtree
+    // is out of range whatever the exact distance.
+    d = -1;
+    if(qd == NULL || !pivot_settles(vp, nd, lo, hi, nndist[k-1])) {
+      d = lo = hi = distance_bounded(vp, p, nd->p, nd->radius + nndist[k-1]);
+
+      // Add to nearest neighbors (maintain sorted order)
+      if(!nd->deleted) {
+        add_knn(k, nn, nndist, nd->p, d);
+      }
+    }
+    if(qd != NULL && e.depth < PIVOT_MAX_DEPTH) {
+      qd[e.depth] = d;
+    }
+
+    if(is_leaf(nd)) {
+      bucket_knn(vp, nd, p, d, k, nn, nndist, qd, e.depth);
+      continue;
+    }
+
+    // Make room for every child
+    if(top + vp->opts.arity > size) {
+      grow = size;
+      while(top + vp->opts.arity > grow) {
+        grow *= 2;
+      }
+      if(stack == local) {
+        grown = (nnentry *)allocate(vp, sizeof(nnentry) * grow);
+        if(grown != NULL) {
+          memcpy(grown, local, sizeof(nnentry) * top);
+        }
+      }
+      else {
+        grown = (nnentry *)reallocate(vp, stack, sizeof(nnentry) * grow);
+      }
+      if(grown == NULL) {
+        ret = -1;
+        break;
+      }
+      stack = grown;
+      size = grow;
+    }
+
+    top = push_children(vp, nd, lo, hi, nndist[k-1], e.depth, stack, top);
+  }
+
+  if(stack != local) {
+    ctx->stack = stack;
+    ctx->stack_size = size;
+  }
+
+  return ret;
+}
+
+/**
+ * k-NN query on the scratch space of @c ctx, exact unless @c eps > 0
+ *
+ * @arg @c dist Output distances to the neighbors, or NULL if not wanted
+ * @arg @c eps Allowed relative error of the neighbors' distances
+ * @arg @c deadline Time on clock_ns() to give up at, or NULL for none
+ * @returns 1 if the neighbors are exact, 0 if they may be approximate, -1
+ *          on failure
+ */
+static int nearest_neighbor(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn, double *dist, double eps, const long long *deadline)
+{
+  const vptree *vp = ctx->vp;
+  int i, status;
+  double *nndist, skipped;
+  double qd[PIVOT_MAX_DEPTH];
+
+  if (k < 1) {
+    return 1;
+  }
+
+  for(i = 0; i < k; i++) {
+    nn[i] = NULL;
+    if(dist != NULL) {
+      dist[i] = INFINITY;
+    }
+  }
+
+  // Distances to neighbors, kept by the context between queries
+  nndist = query_ctx_nndist(ctx, k);
+  if(nndist == NULL) {
+    return -1;
+  }
+  for(i = 0; i < k; i++) {
+    nndist[i] = INFINITY;
+  }
+
+  // Call real algorithm
+  status = nn_query(ctx, vp->root, p, k, nn, nndist,
+                    (vp->opts.pivot_history > 0) ? qd : NULL,
+                    1 / (1 + eps), &skipped, deadline);
+  knn_finish(k, nn, nndist);
+
+  if(dist != NULL) {
+    memcpy(dist, nndist, sizeof(double) * k);
+  }
+
+  if(status != 0) {
+    return -1;
+  }
+
+  // Skipped subtrees could not have held anything closer than the k-th
+  // neighbor finally found
+  return skipped >= nndist[k-1] ? 1 : 0;
+}
+
+void vptree_nearest_neighbor_ctx(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn)
+{
+  nearest_neighbor(ctx, p, k, nn, NULL, 0, NULL);
+}
+
+void vptree_nearest_neighbor(
+  const vptree *vp, const void *p,
+	int k, const void **nn)
+{
+  vptree_query_ctx ctx;
+
+  query_ctx_init(&ctx, vp);
+  nearest_neighbor(&ctx, p, k, nn, NULL, 0, NULL);
+  query_ctx_release(&ctx);
+}
+
+void vptree_nearest_neighbor_dist(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist)
+{
+  vptree_query_ctx ctx;
+
+  query_ctx_init(&ctx, vp);
+  nearest_neighbor(&ctx, p, k, nn, dist, 0, NULL);
+  query_ctx_release(&ctx);
+}
+
+/**
+ * Batches smaller than this are answered serially
+ */
+#define BATCH_CUTOFF (64)
+
+int vptree_nearest_neighbor_eps(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist, double eps)
+{
+  vptree_query_ctx ctx;
+  int exact;
+
+  if(eps < 0) {
+    eps = 0;
+  }
+
+  query_ctx_init(&ctx, vp);
+  exact = nearest_neighbor(&ctx, p, k, nn, dist, eps, NULL);
+  query_ctx_release(&ctx);
+
+  return exact;
+}
+
+int vptree_nearest_neighbor_deadline_ctx(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn, double *dist, long long budget_ns)
+{
+  long long deadline;
+
+  if(budget_ns < 0) {
+    budget_ns = 0;
+  }
+
+  // A budget past the end of the clock is no limit at all
+  deadline = clock_ns();
+  if(budget_ns > LLONG_MAX - deadline) {
+    return nearest_neighbor(ctx, p, k, nn, dist, 0, NULL);
+  }
+  deadline += budget_ns;
+
+  // The clock is first read after a few nodes, so even a spent budget
+  // gets the neighbors on the way down to the query
+  return nearest_neighbor(ctx, p, k, nn, dist, 0, &deadline);
+}
+
+int vptree_nearest_neighbor_deadline(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist, long long budget_ns)
+{
+  vptree_query_ctx ctx;
+  int finished;
+
+  query_ctx_init(&ctx, vp);
+  finished = vptree_nearest_neighbor_deadline_ctx(&ctx, p, k, nn, dist, budget_ns);
+  query_ctx_release(&ctx);
+
+  return finished;
+}
+
+void vptree_nearest_neighbor_many(
+  const vptree *vp, int n, const void * const *p,
+  int k, const void **nn)
+{
+  int i, nthreads;
+  vptree_query_ctx ctx;
+
+  if(k < 1) {
+    return;
+  }
+
+  nthreads = 1;
+#ifdef _OPENMP
+  if(vp->opts.num_threads > 1 && n >= BATCH_CUTOFF) {
+    nthreads = vp->opts.num_threads;
+  }
+#endif
+
+  // Each thread answers queries from the batch with its own scratch space
+  #pragma omp parallel num_threads(nthreads) if(nthreads > 1) private(i, ctx)
+  {
+    query_ctx_init(&ctx, vp);
+
+    // Query cost varies with the query, so hand out small chunks
+    #pragma omp for schedule(dynamic, 16)
+    for(i = 0; i < n; i++) {
+      nearest_neighbor(&ctx, p[i], k, nn + (size_t)i * k, NULL, 0, NULL);
+    }
+
+    query_ctx_release(&ctx);
+  }
+}
+
+////////////////////////////// Neighborhood Query ///////////////////////
+
+/**
+ * Output arrays for a neighborhood query, grown by doubling
+ */
+typedef struct {
+  const vptree *vp;
+  const void **nbr;
+
+  /**
+   * Distances to the points, kept only if @c want_dist
+   */
+  double *dist;
+  bool want_dist;
+
+  int n, capacity;
+  bool failed;
+} nbrbuf;
+
+/**
+ * Append @c p, at distance @c d from the query, to the nbrbuf @c user_data.
+ *
+ * @returns Nonzero to stop the search, if the buffers cannot grow
+ */
+static int nbrbuf_add(void *user_data, const void *p, double d)
+{
+  nbrbuf *buf = (nbrbuf *)user_data;
+  const void **nbr;
+  double *dist;
+  int capacity;
+
+  if(buf->n == buf->capacity) {
+    capacity = (buf->capacity > 0) ? 2 * buf->capacity : 16;
+
+    nbr = (const void **)reallocate(buf->vp, buf->nbr, capacity * sizeof(const void *));
+    if(nbr == NULL) {
+      buf->failed = true;
+      return 1;
+    }
+    buf->nbr = nbr;
+
+    if(buf->want_dist) {
+      dist = (double *)reallocate(buf->vp, buf->dist, capacity * sizeof(double));
+      if(dist == NULL) {
+        buf->failed = true;
+        return 1;
+      }
+      buf->dist = dist;
+    }
+
+    buf->capacity = capacity;
+  }
+
+  buf->nbr[buf->n] = p;
+  if(buf->want_dist) {
+    buf->dist[buf->n] = d;
+  }
+  buf->n++;
+
+  return 0;
+}
+
+/**
+ * State of a neighborhood query
+ */
+typedef struct {
+  const vptree *vp;
+  const void *p;
+  double epsilon;
+
+  /**
+   * Called with each point found, or NULL to only count them
+   */
+  vptree_neighbor_visitor visit;
+  void *user_data;
+  int count;
+
+  /**
+   * Subtrees entirely inside the ball may be taken whole, without computing
+   * distances; their points are passed to @c visit with distance -1
+   */
+  bool bulk;
+
+  /**
+   * The query's distances to the vantage points on the current path, or
+   * NULL to not use the pivot history
+   */
+  double *qd;
+} epsquery;
+
+/**
+ * Report point @c p at distance @c d from the query.
+ *
+ * @returns true if the visitor stopped the search
+ */
+static bool epsilon_report(epsquery *eq, const void *p, double d)
+{
+  if(eq->visit == NULL) {
+    eq->count++;
+    return false;
+  }
+
+  return eq->visit(eq->user_data, p, d) != 0;
 }
 
-int vptree_add(vptree *vp, const void *p)
+/**
+ * Report those of @c n points inside the ball, with one call to
+ * distance_many
+ *
+ * @returns true if the visitor stopped the search
+ */
+static bool epsilon_report_batch(epsquery *eq, int n, const void * const *batch)
 {
-  return vptree_add_many(vp, 1, &p);
-}
+  double d[DISTANCE_BATCH];
+  int i;
 
-//////////////////////////////// k-NN Query ////////////////////////////
+  distance_many(eq->vp, eq->p, n, batch, d);
+  for(i = 0; i < n; i++) {
+    if(d[i] < eq->epsilon && epsilon_report(eq, batch[i], d[i])) {
+      return true;
+    }
+  }
+
+  return false;
+}
 
 /**
- * Add @c ndp at distance @c d from the query point to the nearest neighbors.
+ * Report every point in the subtree at @c nd, which lies inside the ball.
  *
- * Will maintain the neighbor list in ascending order of distance from the
- * query point.
- *
- * @note If @c d is greater than the distance from the furthest of the @c k
- *       existing neighbors, this is a noop.
+ * @returns true if the visitor stopped the search
  */
-static void add_knn(int k, const void **nn, double *nndist, const void *ndp, double d)
+static bool epsilon_bulk(epsquery *eq, const node *nd)
 {
-  int i, j;
+  const leaf *lf;
+  node **child;
+  int i;
 
-  assert(k >= 1);
+  if(nd == NULL) {
+    return false;
+  }
 
-  if(d >= nndist[k-1]) {
-    return;
+  if(eq->visit == NULL) {
+    eq->count += nd->size - nd->ndeleted;
+    return false;
   }
-  
-  for(i = 0; i < k && nndist[i] < d; i++);
-  for(j = k-1; j > i; j--) {
-    nn[j] = nn[j-1];
-    nndist[j] = nndist[j-1];
+
+  if(!nd->deleted && epsilon_report(eq, nd->p, -1)) {
+    return true;
+  }
+  if(is_leaf(nd)) {
+    lf = node_leaf(eq->vp, nd);
+    for(i = 0; i < lf->nbucket; i++) {
+      if(epsilon_report(eq, lf->bucket[i].p, -1)) {
+        return true;
+      }
+    }
+    return false;
   }
-  nn[i] = ndp;
-  nndist[i] = d;
-}
 
+  child = node_child(eq->vp, nd);
+  for(i = 0; i < eq->vp->opts.arity; i++) {
+    if(epsilon_bulk(eq, child[i])) {
+      return true;
+    }
+  }
 
-static void nn_query(
-  const vptree *vp, node *nd,
-  const void *p, int k,
-  const void **nn, double *nndist)
-{
-  double d, mu;
-  int i, j;
+  return false;
+}
 
-  assert(k >= 1);
+/**
+ * Report each point within @c eq->epsilon of the query in the subtree at
+ * @c nd, at depth @c depth.
+ *
+ * @returns true if the visitor stopped the search
+ */
+static bool epsilon_query(epsquery *eq, node *nd, int depth)
+{
+  const vptree *vp = eq->vp;
+  const void *batch[DISTANCE_BATCH];
+  double d, bd, lo, hi, epsilon;
+  double *qd, *bound;
+  node **child;
+  const leaf *lf;
+  const bucketp *b;
+  int i, h, last, nbatch;
 
   if(nd == NULL) {
-    return;
+    return false;
   }
 
-  // Calculate distance to current node
-  d = distance(vp, p, nd->p);
+  epsilon = eq->epsilon;
+  qd = eq->qd;
+  h = vp->opts.pivot_history;
+  lo = 0;
+  hi = INFINITY;
+  if(qd != NULL) {
+    pivot_bounds(h, node_anc(vp, nd), qd, depth, &lo, &hi);
+  }
 
-  // Add to nearest neighbors (maintain sorted order)
-  add_knn(k, nn, nndist, nd->p, d);
+  // Calculate distance to current node, unless the bounds settle it or
+  // already put the whole subtree inside the ball
+  d = -1;
+  if(!(eq->bulk && hi + nd->radius < epsilon) &&
+     (qd == NULL || !pivot_settles(vp, nd, lo, hi, epsilon))) {
+    d = lo = hi = distance_bounded(vp, eq->p, nd->p, nd->radius + epsilon);
+  }
+  if(qd != NULL && depth < PIVOT_MAX_DEPTH) {
+    qd[depth] = d;
+  }
 
-  // Recurse to children
-  mu = nd->mu;
-  if(mu < 0) {
-    return;
+  // Covering radius: the subtree is either entirely inside or outside
+  if(eq->bulk && hi + nd->radius < epsilon) {
+    return epsilon_bulk(eq, nd);
   }
-  
-  if(d - nndist[k-1] < mu) {
-    nn_query(vp, nd->lt, p, k, nn, nndist);
+  if(lo - nd->radius >= epsilon) {
+    return false;
   }
-  if(d + nndist[k-1] >= mu) {
-    nn_query(vp, nd->ge, p, k, nn, nndist);
+
+  if(d >= 0 && d < epsilon && !nd->deleted && epsilon_report(eq, nd->p, d)) {
+    return true;
   }
-}
 
-void vptree_nearest_neighbor(
-  const vptree *vp, const void *p,
-	int k, const void **nn)
-{
-  int i;
-  double *nndist;
+  if(is_leaf(nd)) {
+    lf = node_leaf(vp, nd);
+    nbatch = 0;
+    for(i = 0, b = lf->bucket; i < lf->nbucket; i++, b++) {
+      if(d >= 0 && fabs(d - b->d) >= epsilon) {
+        continue;
+      }
+      if(qd != NULL) {
+        pivot_bounds(h, lf->anc + h * i, qd, depth, &lo, &hi);
+        if(lo >= epsilon) {
+          continue;
+        }
+      }
 
-  if (k < 1) {
-    return;
-  }
+      if(vp->opts.distance_many == NULL) {
+        bd = distance_bounded(vp, eq->p, b->p, epsilon);
+        if(bd < epsilon && epsilon_report(eq, b->p, bd)) {
+          return true;
+        }
+        continue;
+      }
 
-  // Set up temporary array for storing distances to neighbors
-  nndist = (double *)allocate(vp, sizeof(double) * k);
-  for(i = 0; i < k; i++) {
-    nn[i] = NULL;
-    nndist[i] = INFINITY;
+      batch[nbatch++] = b->p;
+      if(nbatch == DISTANCE_BATCH) {
+        if(epsilon_report_batch(eq, nbatch, batch)) {
+          return true;
+        }
+        nbatch = 0;
+      }
+    }
+    return nbatch > 0 && epsilon_report_batch(eq, nbatch, batch);
   }
 
-  // Call real algorithm
-  nn_query(vp, vp->root, p, k, nn, nndist);
+  bound = node_bound(vp, nd);
+  child = node_child(vp, nd);
+  last = vp->opts.arity - 1;
+  for(i = 0; i < last; i++) {
+    if(lo - epsilon < bound[2*i + 1] && hi + epsilon > bound[2*i]) {
+      if(epsilon_query(eq, child[i], depth + 1)) {
+        return true;
+      }
+    }
+  }
+  if(lo - epsilon < bound[2*last + 1] && hi + epsilon > bound[2*last]) {
+    return epsilon_query(eq, child[last], depth + 1);
+  }
 
-  // Cleanup
-  deallocate(vp, nndist);
+  return false;
 }
 
-////////////////////////////// Neighborhood Query ///////////////////////
+static void epsquery_init(epsquery *eq, const vptree *vp, const void *p, double epsilon,
+                          double *qd)
+{
+  eq->vp = vp;
+  eq->p = p;
+  eq->epsilon = epsilon;
+  eq->visit = NULL;
+  eq->user_data = NULL;
+  eq->count = 0;
+  eq->bulk = false;
+  eq->qd = (vp->opts.pivot_history > 0) ? qd : NULL;
+}
 
-static void add_nbr_point(const vptree *vp, int *n, const void ***nbr, const void *p)
+int vptree_neighborhood_visit(
+  const vptree *vp, const void *p, double distance,
+  void *user_data, vptree_neighbor_visitor visit)
 {
-  *n += 1;
-  *nbr = reallocate(vp, *nbr, *n * sizeof(const void *));
-  (*nbr)[*n - 1] = p;
+  epsquery eq;
+  double qd[PIVOT_MAX_DEPTH];
+
+  epsquery_init(&eq, vp, p, distance, qd);
+  eq.visit = visit;
+  eq.user_data = user_data;
+
+  return epsilon_query(&eq, vp->root, 0);
 }
 
-static void epsilon_query(const vptree *vp, node *nd, const void *p, double epsilon,
-                          int *nfound, const void ***nbr)
+int vptree_range_count(const vptree *vp, const void *p, double distance)
 {
-  double d, mu;
+  epsquery eq;
+  double qd[PIVOT_MAX_DEPTH];
 
-  if(nd == NULL) {
-    return;
-  }
+  epsquery_init(&eq, vp, p, distance, qd);
+  eq.bulk = true;
+  epsilon_query(&eq, vp->root, 0);
 
-  d = distance(vp, p, nd->p);
-  if(d < epsilon) {
-    add_nbr_point(vp, nfound, nbr, nd->p);
-  }
+  return eq.count;
+}
 
-  mu = nd->mu;
-  if(mu < 0) {
-    return;
+int vptree_neighborhood_buffer(
+  const vptree *vp, const void *p, double distance,
+  const void ***nbr, double **dist, int *capacity)
+{
+  nbrbuf buf;
+  epsquery eq;
+  double qd[PIVOT_MAX_DEPTH];
+
+  buf.vp = vp;
+  buf.nbr = *nbr;
+  buf.dist = (dist != NULL) ? *dist : NULL;
+  buf.want_dist = (dist != NULL);
+  buf.n = 0;
+  buf.capacity = *capacity;
+  buf.failed = false;
+
+  // Without distances, whole subtrees can be taken at once
+  epsquery_init(&eq, vp, p, distance, qd);
+  eq.visit = nbrbuf_add;
+  eq.user_data = &buf;
+  eq.bulk = !buf.want_dist;
+  epsilon_query(&eq, vp->root, 0);
+
+  *nbr = buf.nbr;
+  if(dist != NULL) {
+    *dist = buf.dist;
   }
+  *capacity = buf.capacity;
 
-  if(d - epsilon < mu) {
-    epsilon_query(vp, nd->lt, p, epsilon, nfound, nbr);
-  }
-  if(d + epsilon >= mu) {
-    epsilon_query(vp, nd->ge, p, epsilon, nfound, nbr);
-  }
+  return buf.failed ? -1 : buf.n;
 }
 
-
 const void **vptree_neighborhood(
   const vptree *vp, const void *p, double distance,
   int *n)
 {
   const void **nbr;
+  int capacity;
 
-  *n = 0;
   nbr = NULL;
+  capacity = 0;
+  *n = vptree_neighborhood_buffer(vp, p, distance, &nbr, NULL, &capacity);
+  if(*n < 0) {
+    *n = 0;
+  }
+
+  return nbr;
+}
+
+const void **vptree_neighborhood_dist(
+  const vptree *vp, const void *p, double distance,
+  int *n, double **dist)
+{
+  const void **nbr;
+  int capacity;
 
-  epsilon_query(vp, vp->root, p, distance, n, &nbr);
+  nbr = NULL;
+  *dist = NULL;
+  capacity = 0;
+  *n = vptree_neighborhood_buffer(vp, p, distance, &nbr, dist, &capacity);
+  if(*n < 0) {
+    *n = 0;
+  }
 
   return nbr;
 }
 
 /////////////////////////////// Incremental knn /////////////////////////
 
-static void destroy_inctree(const vptree *vp, incnode *n)
+/**
+ * Incremental searches start with room for this many queue entries
+ */
+#define INCNN_HEAP_SIZE (64)
+
+/**
+ * Whether @c a leaves the queue before @c b: nearer first, and points with
+ * known distances before bounds at the same distance
+ */
+static bool incentry_before(const incentry *a, const incentry *b)
 {
-  if(n == NULL) {
-    return;
+  if(a->key != b->key) {
+    return a->key < b->key;
   }
-
-  destroy_inctree(vp, n->lt);
-  destroy_inctree(vp, n->ge);
-  deallocate(vp, n);
+  return (a->nd == NULL && !a->pending) && !(b->nd == NULL && !b->pending);
 }
 
-static incnode *make_incnode(const vptree *vp, incnode *parent, node *n, const void *q)
+/**
+ * Queue the subtree @c nd, or if it is NULL the point @c p, with key
+ * @c key.  @c pending if @c key is only a bound on the point's distance.
+ *
+ * @returns -1 if the queue could not grow, otherwise 0
+ */
+static int incnn_push(vptree_incnn *inc, double key, node *nd, const void *p,
+                      bool pending)
 {
-  incnode *incn;
+  incentry e, *grown;
+  int i, parent, capacity;
 
-  if(n == NULL) {
-    return NULL;
+  // Nothing here could be returned
+  if(key >= inc->max_dist) {
+    return 0;
   }
 
-  incn = allocate(vp, sizeof(incnode));
-  incn->n = n;
-  incn->d = distance(vp, n->p, q);
-  incn->exclude_tree = incn->exclude = false;
-  
-  incn->parent = parent;
-  incn->ge = incn->lt = NULL;
+  if(inc->size == inc->capacity) {
+    capacity = (inc->capacity > 0) ? 2 * inc->capacity : INCNN_HEAP_SIZE;
+    if(inc->heap == NULL) {
+      grown = (incentry *)allocate(inc->vp, sizeof(incentry) * capacity);
+    }
+    else {
+      grown = (incentry *)reallocate(inc->vp, inc->heap, sizeof(incentry) * capacity);
+    }
+    if(grown == NULL) {
+      return -1;
+    }
+    inc->heap = grown;
+    inc->capacity = capacity;
+  }
+
+  e.key = key;
+  e.nd = nd;
+  e.p = p;
+  e.pending = pending;
+
+  // Sift up
+  i = inc->size++;
+  while(i > 0) {
+    parent = (i - 1) / 2;
+    if(!incentry_before(&e, &inc->heap[parent])) {
+      break;
+    }
+    inc->heap[i] = inc->heap[parent];
+    i = parent;
+  }
+  inc->heap[i] = e;
 
-  return incn;
+  return 0;
 }
 
-static void prune_marks(const vptree *vp, incnode *n)
+/**
+ * Remove the front of the non-empty queue
+ */
+static incentry incnn_pop(vptree_incnn *inc)
 {
-  bool lt_excluded, ge_excluded;
+  incentry front, last;
+  int i, child;
+
+  front = inc->heap[0];
+  last = inc->heap[--inc->size];
 
-  // Check if entire tree below n is marked
-  if(n->lt == NULL) {
-    lt_excluded = (n->n->lt == NULL);
+  // Sift the last entry down from the root
+  i = 0;
+  for(;;) {
+    child = 2 * i + 1;
+    if(child >= inc->size) {
+      break;
+    }
+    if(child + 1 < inc->size && incentry_before(&inc->heap[child + 1], &inc->heap[child])) {
+      child++;
+    }
+    if(!incentry_before(&inc->heap[child], &last)) {
+      break;
+    }
+    inc->heap[i] = inc->heap[child];
+    i = child;
   }
-  else {
-    lt_excluded = n->lt->exclude_tree;
+  if(inc->size > 0) {
+    inc->heap[i] = last;
+  }
+
+  return front;
+}
+
+/**
+ * Queue the vantage point, bucket points and children of @c nd, whose
+ * points are no nearer than @c lb.  Nothing is queued if every point of
+ * @c nd is beyond the search's maximum distance.
+ *
+ * @returns -1 if the queue could not grow, otherwise 0
+ */
+static int incnn_expand(vptree_incnn *inc, node *nd, double lb)
+{
+  const vptree *vp = inc->vp;
+  const void *batch[DISTANCE_BATCH];
+  double d, bd[DISTANCE_BATCH], lo, hi, clb;
+  const leaf *lf;
+  node **child;
+  int i, j, m;
+
+  // Past the covering radius plus the maximum distance, the whole subtree
+  // is out of range whatever the exact distance
+  d = distance_bounded(vp, inc->q, nd->p, nd->radius + inc->max_dist);
+  if(d > nd->radius + inc->max_dist) {
+    return 0;
+  }
+  if(!nd->deleted && incnn_push(inc, d, NULL, nd->p, false) == -1) {
+    return -1;
   }
 
-  if(n->ge == NULL) {
-    ge_excluded = (n->n->ge == NULL);
+  // Bucket points wait behind the triangle inequality bound |d - b->d|,
+  // unless distance_many makes computing them together cheaper
+  lf = node_leaf(vp, nd);
+  if(is_leaf(nd) && vp->opts.distance_many == NULL) {
+    for(i = 0; i < lf->nbucket; i++) {
+      clb = fabs(d - lf->bucket[i].d);
+      if(incnn_push(inc, (clb > lb) ? clb : lb, NULL, lf->bucket[i].p, true) == -1) {
+        return -1;
+      }
+    }
+    return 0;
   }
-  else {
-    ge_excluded = n->ge->exclude_tree;
+  if(is_leaf(nd)) {
+    for(i = 0; i < lf->nbucket; i += m) {
+      m = (lf->nbucket - i < DISTANCE_BATCH) ? lf->nbucket - i : DISTANCE_BATCH;
+      for(j = 0; j < m; j++) {
+        batch[j] = lf->bucket[i + j].p;
+      }
+      distance_many(vp, inc->q, m, batch, bd);
+      for(j = 0; j < m; j++) {
+        if(incnn_push(inc, bd[j], NULL, batch[j], false) == -1) {
+          return -1;
+        }
+      }
+    }
+    return 0;
   }
 
-  // Prune mark tree and mark parent
-  if(lt_excluded && ge_excluded && n->exclude) {
-    deallocate(vp, n->lt);
-    deallocate(vp, n->ge);
-    n->lt = n->ge = NULL;
-    n->exclude_tree = true;
- 
-    if(n->parent != NULL) {
-      prune_marks(vp, n->parent);
+  // A child's points are no nearer than its shell allows, nor than its
+  // parent's
+  child = node_child(vp, nd);
+  for(i = 0; i < vp->opts.arity; i++) {
+    if(child[i] == NULL) {
+      continue;
+    }
+    child_range(vp, nd, i, &lo, &hi);
+    clb = lb;
+    if(lo - d > clb) {
+      clb = lo - d;
+    }
+    if(d - hi > clb) {
+      clb = d - hi;
+    }
+    if(incnn_push(inc, clb, child[i], NULL, false) == -1) {
+      return -1;
     }
   }
+
+  return 0;
 }
 
 vptree_incnn *vptree_incnn_begin(const vptree *vp, const void *q)
@@ -550,84 +3029,79 @@ vptree_incnn *vptree_incnn_begin(const vptree *vp, const void *q)
   vptree_incnn *inc;
 
   inc = (vptree_incnn *)allocate(vp, sizeof(vptree_incnn));
+  if(inc == NULL) {
+    return NULL;
+  }
   inc->vp = vp;
   inc->q = q;
-  
-  inc->prev = inc->marks = make_incnode(vp, NULL, vp->root, q);
+  inc->heap = NULL;
+  inc->size = 0;
+  inc->capacity = 0;
+  inc->max_dist = INFINITY;
+
+  if(vp->root != NULL && incnn_push(inc, 0, vp->root, NULL, false) == -1) {
+    vptree_incnn_end(inc);
+    return NULL;
+  }
 
   return inc;
 }
 
-
-static void incnn_query(vptree_incnn *inc, incnode *mark, incnode **nn, double *nnd, incnode *exclude)
+const void *vptree_incnn_next_dist(vptree_incnn *inc, double *dist)
 {
-  const vptree *vp;
-  double d, mu;
-
-  if(mark == NULL || mark->exclude_tree || mark == exclude) {
-    return;
-  }
-
-  vp = inc->vp;
-  d = mark->d;
-
-  // Set as nearest neighbor
-  if(d < *nnd && !mark->exclude) {
-    *nn = mark;
-    *nnd = d;
-  }
-
-  // Recurse to children
-  mu = mark->n->mu;
-  if(mu < 0) {
-    return;
-  }
+  incentry e;
+  double d;
 
-  if(d - *nnd < mu) {
-    if(mark->lt == NULL) {
-      mark->lt = make_incnode(vp, mark, mark->n->lt, inc->q);
+  // Best-first search, as in Hjaltason and Samet: expand subtrees from the
+  // front of the queue until a point reaches it.  Everything behind it is
+  // at least as far away.
+  while(inc->size > 0 && inc->heap[0].key < inc->max_dist) {
+    e = incnn_pop(inc);
+    if(e.nd == NULL && e.pending) {
+      d = distance_bounded(inc->vp, inc->q, e.p, inc->max_dist);
+      if(incnn_push(inc, d, NULL, e.p, false) == -1) {
+        break;
+      }
+      continue;
     }
-    incnn_query(inc, mark->lt, nn, nnd, NULL);
-  }
-  if(d + *nnd >= mu) {
-    if(mark->ge == NULL) {
-      mark->ge = make_incnode(vp, mark, mark->n->ge, inc->q);
+    if(e.nd == NULL) {
+      if(dist != NULL) {
+        *dist = e.key;
+      }
+      return e.p;
+    }
+
+    if(incnn_expand(inc, e.nd, e.key) == -1) {
+      break;
     }
-    incnn_query(inc, mark->ge, nn, nnd, NULL);
   }
+
+  return NULL;
 }
 
 const void *vptree_incnn_next(vptree_incnn *inc)
 {
-  double nnd;
-  incnode *nn, *query, *lastquery;
-  const void *result;
-
-  nn = NULL;
-  nnd = INFINITY;
-
-  // Walk up the tree to find more nodes
-  lastquery = NULL;
-  query = inc->prev;
-  while(query != NULL) {
-    incnn_query(inc, query, &nn, &nnd, lastquery);
+  return vptree_incnn_next_dist(inc, NULL);
+}
 
-    lastquery = query;
-    query = query->parent;
-  }
+int vptree_incnn_next_many(vptree_incnn *inc, int m, const void **nn, double *dist)
+{
+  int i;
 
-  // Return result
-  if(nn == NULL) {
-    return NULL;
+  for(i = 0; i < m; i++) {
+    nn[i] = vptree_incnn_next_dist(inc, (dist != NULL) ? &dist[i] : NULL);
+    if(nn[i] == NULL) {
+      break;
+    }
   }
-  else {
-    // Mark node as returns
-    result = nn->n->p;
 
-    nn->exclude = true;
-    prune_marks(inc->vp, nn);
+  return i;
+}
 
-    return result;
+void vptree_incnn_set_max_distance(vptree_incnn *inc, double max_dist)
+{
+  if(max_dist < inc->max_dist) {
+    inc->max_dist = max_dist;
   }
 }
 
@@ -638,20 +3112,15 @@ void vptree_incnn_end(vptree_incnn *inc)
     return;
   }
 
-  destroy_inctree(inc->vp, inc->marks);
+  if(inc->heap != NULL) {
+    deallocate(inc->vp, inc->heap);
+  }
   deallocate(inc->vp, inc);
 }
 
 ////////////////////////////// Approximate k-NN /////////////////////////
 
 
-typedef struct {
-  node *nd;
-
-  size_t pos;
-  double prio;
-} pqnode;
-
 static int pqueue_cmp_prio(double next, double curr)
 {
   if(curr < next) {
@@ -683,97 +3152,174 @@ static void pqueue_set_pos(void *ptr, size_t pos)
 }
 
 static void add_knn(int k, const void **nn, double *nndist, const void *ndp, double d);
+static void knn_finish(int k, const void **nn, double *nndist);
 
-void vptree_nearest_neighbor_approx(
-  const vptree *vp, const void *p,
-	int k, const void **nn, int max_nodes)
+/**
+ * Approximate k-NN query on the scratch space of @c ctx
+ *
+ * @arg @c dist Output distances to the neighbors, or NULL if not wanted
+ */
+static void nearest_neighbor_approx(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn, double *dist, int max_nodes)
 {
-  int i, next_node, r, visited;
-  double *nndist, d, mu;
+  const vptree *vp = ctx->vp;
+  int i, arity, next_node, r, visited, npnodes;
+  double *nndist, d, lo, hi, lb;
   pqnode *pnodes, *pnd;
-  node *nd;
+  node *nd, **child;
   pqueue_t *pq;
 
   if (k < 1) {
     return;
   }
 
-  if(max_nodes > vp->n) {
-    max_nodes = vp->n;
+  // No more nodes than points, including tombstones
+  if(vp->root == NULL) {
+    max_nodes = 0;
+  }
+  else if(max_nodes > vp->root->size) {
+    max_nodes = vp->root->size;
   }
 
   // Initialize nn state
-  nndist = (double *)allocate(vp, sizeof(double) * k);
-  assert(nndist != NULL);
   for(i = 0; i < k; i++) {
-    nndist[i] = INFINITY;
     nn[i] = NULL;
+    if(dist != NULL) {
+      dist[i] = INFINITY;
+    }
+  }
+  nndist = query_ctx_nndist(ctx, k);
+  if(nndist == NULL) {
+    return;
+  }
+  for(i = 0; i < k; i++) {
+    nndist[i] = INFINITY;
   }
 
   // Initialize priority queue
-  // Sized for visiting 2 children per node (for max_nodes) + the root
-  pnodes = (pqnode *)allocate(vp, sizeof(pqnode) * (2 * max_nodes + 1));
-  assert(pnodes != NULL);
+  // Sized for visiting every child per node (for max_nodes) + the root
+  arity = vp->opts.arity;
+  npnodes = arity * max_nodes + 1;
+  if(ctx->pnodes_size < npnodes) {
+    if(ctx->pnodes != NULL) {
+      deallocate(vp, ctx->pnodes);
+    }
+    ctx->pnodes = (pqnode *)allocate(vp, sizeof(pqnode) * npnodes);
+    ctx->pnodes_size = (ctx->pnodes != NULL) ? npnodes : 0;
+  }
+  if(ctx->pq == NULL || ctx->pq->avail < (size_t)npnodes) {
+    if(ctx->pq != NULL) {
+      pqueue_free(ctx->pq);
+    }
+    ctx->pq = pqueue_init(
+      /*n=*/npnodes - 1,
+      pqueue_cmp_prio,
+      pqueue_get_prio,
+      pqueue_set_prio,
+      pqueue_get_pos,
+      pqueue_set_pos,
+      vp->opts.allocate,
+      vp->opts.deallocate,
+      vp->opts.reallocate,
+      vp->opts.user_data);
+  }
+  if(ctx->pnodes == NULL || ctx->pq == NULL) {
+    return;
+  }
+  pnodes = ctx->pnodes;
+  pq = ctx->pq;
+  pqueue_clear(pq);
 
   pnodes[0].nd = vp->root;
   pnodes[0].prio = 0;
   next_node = 1;
 
-  pq = pqueue_init(
-    /*n=*/2 * max_nodes,
-    pqueue_cmp_prio,
-    pqueue_get_prio,
-    pqueue_set_prio,
-    pqueue_get_pos,
-    pqueue_set_pos,
-    vp->opts.allocate,
-    vp->opts.deallocate,
-    vp->opts.reallocate,
-    vp->opts.user_data);
-  assert(pq != NULL);
-
   r = pqueue_insert(pq, &pnodes[0]);
   assert(r == 0);
 
-  // Main loop
-  for(visited = 0; visited < max_nodes; visited++) {
+  // Main loop: nodes come off the queue nearest lower bound first, the
+  // bound being what the parent's shells say about the whole subtree
+  visited = 0;
+  while(visited < max_nodes) {
     pnd = pqueue_pop(pq);
     if(pnd == NULL) {
       break;
     }
     nd = pnd->nd;
 
-    d = distance(vp, p, nd->p);
-    add_knn(k, nn, nndist, nd->p, d);
+    // The k-th neighbor may have moved in since the node was queued
+    if(pnd->prio >= nndist[k-1]) {
+      continue;
+    }
+    visited++;
+
+    d = distance_bounded(vp, p, nd->p, nd->radius + nndist[k-1]);
+    if(!nd->deleted) {
+      add_knn(k, nn, nndist, nd->p, d);
+    }
 
     // Push children onto priority queue
-    mu = nd->mu;
-    if(mu < 0) {
+    if(is_leaf(nd)) {
+      bucket_knn(vp, nd, p, d, k, nn, nndist, NULL, 0);
       continue;
     }
   
-    if(d - nndist[k-1] < mu && nd->lt != NULL) {
-      pnodes[next_node].nd = nd->lt;
-      pnodes[next_node].prio = distance(vp, p, nd->lt->p);
-
-      pqueue_insert(pq, &pnodes[next_node]);
-
-      next_node++;
+    child = node_child(vp, nd);
+    for(i = 0; i < arity; i++) {
+      child_range(vp, nd, i, &lo, &hi);
+      if(d - nndist[k-1] < hi && d + nndist[k-1] > lo && child[i] != NULL) {
+        // A subtree is no nearer than its parent's
+        lb = pnd->prio;
+        if(lo - d > lb) {
+          lb = lo - d;
+        }
+        if(d - hi > lb) {
+          lb = d - hi;
+        }
+        pnodes[next_node].nd = child[i];
+        pnodes[next_node].prio = lb;
+
+        pqueue_insert(pq, &pnodes[next_node]);
+
+        next_node++;
+      }
     }
-    if(d + nndist[k-1] >= mu && nd->ge != NULL) {
-      pnodes[next_node].nd = nd->ge;
-      pnodes[next_node].prio = distance(vp, p, nd->ge->p);
+  }
 
-      pqueue_insert(pq, &pnodes[next_node]);
+  //fprintf(stderr, "Visited %d nodes\n", visited);
+  knn_finish(k, nn, nndist);
 
-      next_node++;
-    }
+  if(dist != NULL) {
+    memcpy(dist, nndist, sizeof(double) * k);
   }
+}
 
-  //fprintf(stderr, "Visited %d nodes\n", visited);
+void vptree_nearest_neighbor_approx_ctx(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn, int max_nodes)
+{
+  nearest_neighbor_approx(ctx, p, k, nn, NULL, max_nodes);
+}
+
+void vptree_nearest_neighbor_approx(
+  const vptree *vp, const void *p,
+	int k, const void **nn, int max_nodes)
+{
+  vptree_query_ctx ctx;
+
+  query_ctx_init(&ctx, vp);
+  nearest_neighbor_approx(&ctx, p, k, nn, NULL, max_nodes);
+  query_ctx_release(&ctx);
+}
+
+void vptree_nearest_neighbor_approx_dist(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist, int max_nodes)
+{
+  vptree_query_ctx ctx;
 
-  // Cleanup
-  pqueue_free(pq);
-  deallocate(vp, pnodes);
-  deallocate(vp, nndist);
+  query_ctx_init(&ctx, vp);
+  nearest_neighbor_approx(&ctx, p, k, nn, dist, max_nodes);
+  query_ctx_release(&ctx);
 }
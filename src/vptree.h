@@ -15,6 +15,21 @@ extern "C" {
 
 typedef struct vptree vptree;
 
+/**
+ * Methods for choosing the vantage point of each node.
+ */
+typedef enum {
+  /* Uniformly at random */
+  VPTREE_VANTAGE_RANDOM = 0,
+
+  /* Candidate with the largest spread (second moment about the median) of
+   * distances to a random sample of the points, as suggested by Yianilos */
+  VPTREE_VANTAGE_SPREAD,
+
+  /* Point farthest from the parent node's vantage point */
+  VPTREE_VANTAGE_FARTHEST
+} vptree_vantage;
+
 typedef struct {
   void *user_data;
 
@@ -25,9 +40,86 @@ typedef struct {
   void *(*allocate)(void *user_data, size_t s);
   void (*deallocate)(void *user_data, void *data);
   void *(*reallocate)(void *user_data, void *data, size_t new_size);
+
+  /* Number of threads used to construct the tree in vptree_add_many, and to
+   * answer the queries of vptree_nearest_neighbor_many.  0 or 1 runs
+   * serially.  With more than one thread, the distance and memory management
+   * closures (and any progress callback) must be thread-safe.  Ignored if the
+   * library was built without OpenMP. */
+  int num_threads;
+
+  /* Vantage point selection */
+  vptree_vantage vantage;
+
+  /* Number of candidates, and of points to sample for each candidate, for
+   * VPTREE_VANTAGE_SPREAD.  Clamped to VPTREE_MAX_VANTAGE_SAMPLES. */
+  int vantage_samples;
+
+  /* Seed for the tree's random number generator.  Trees built from the same
+   * points with the same seed are identical. */
+  unsigned long seed;
+
+  /* Maximum number of points stored in each leaf node.  Points in a leaf are
+   * kept in a contiguous array with their distances to the leaf's vantage
+   * point, and scanned linearly.  1 stores one point per node. */
+  int leaf_size;
+
+  /* Size in bytes of the slabs that nodes are allocated from.  0 allocates
+   * each node separately.  Otherwise nodes are carved from slabs obtained
+   * through allocate, and the whole tree is freed slab by slab. */
+  size_t slab_size;
+
+  /* Scapegoat rebalancing for insertions into an existing tree.  When adding
+   * points would leave one child of a node with more than this fraction of
+   * the node's subtree, the subtree is rebuilt with fresh median splits.
+   * Should be between 0.5 and 1; 0 disables rebalancing. */
+  double rebalance_alpha;
+
+  /* Compaction after vptree_remove.  When removed points make up more than
+   * this fraction of a subtree, it is rebuilt from its remaining points.
+   * 0 disables automatic compaction (see vptree_compact). */
+  double compact_ratio;
+
+  /* Number of ancestor vantage points whose distances are kept with each
+   * point, like a LAESA pivot table.  k-NN and neighborhood queries combine
+   * them with the query's distances to the same ancestors, computed on the
+   * way down, to rule out points without calling distance.  Worthwhile for
+   * expensive metrics; costs this many doubles per point.  0 disables;
+   * clamped to VPTREE_MAX_PIVOT_HISTORY. */
+  int pivot_history;
+
+  /* Number of children of each internal node.  Points are split into this
+   * many shells of equal size by their distance to the vantage point, as in
+   * an mvp-tree.  2 builds a binary vp-tree; wider nodes make a shallower
+   * tree with fewer vantage points to compute distances to.  Clamped to
+   * VPTREE_MAX_ARITY. */
+  int arity;
+
+  /* Optional distance closure that may give up early.  Must return the
+   * exact distance when it is at most bound; otherwise it may stop as soon
+   * as the distance is known to exceed bound, and return any value above
+   * bound.  Queries call it where only a distance within their current
+   * search radius matters, e.g. with a partial-sum early abandon for L2 or
+   * DTW.  NULL always uses distance. */
+  double (*distance_bounded)(void *user_data, const void *p1, const void *p2,
+                             double bound);
+
+  /* Optional closure setting out[i] to the distance from q to p[i], for
+   * each of the n points.  Used in place of distance where many points are
+   * compared to one vantage point or query: splitting points while
+   * building, and scanning leaf buckets (instead of distance_bounded) while
+   * searching.  Lets the metric vectorize across points, and language
+   * bindings cross over once per batch rather than once per pair.  NULL
+   * calls distance for each point. */
+  void (*distance_many)(void *user_data, const void *q, int n,
+                        const void * const *p, double *out);
   
 } vptree_options;
 
+#define VPTREE_MAX_VANTAGE_SAMPLES (64)
+#define VPTREE_MAX_PIVOT_HISTORY (16)
+#define VPTREE_MAX_ARITY (16)
+
 extern const vptree_options vptree_default_options;
 
 /**
@@ -62,6 +154,11 @@ int vptree_npoints(const vptree *vp);
 /**
  * Adds p at a leaf node in the vp-tree.
  *
+ * Subtrees that become unbalanced are rebuilt (see
+ * vptree_options.rebalance_alpha), keeping the amortized cost logarithmic.
+ * Points at equal distances cannot be split apart, so inserting many
+ * duplicates also costs time proportional to the number of copies.
+ *
  * @note Pointer @c p must be valid for the lifetime of the vp-tree
  * @returns 0 on success, nonzero on failure
  */
@@ -81,7 +178,10 @@ int vptree_add_many(vptree *vp, int n, const void * const *p);
  * Add multiple entries to a vp-tree simultaneously.
  *
  * Optimally splits at each level using all available data.  Calls provided
- * function with each node added to the tree.
+ * function as points are placed in the tree, with the number placed so far.
+ * When building with more than
+ * one thread, calls to @c callback are serialized but may come from any
+ * thread.
  *
  * @note Pointers @c p[0] to @c p[n-1] must be valid for the lifetime of the vp-tree
  */
@@ -89,6 +189,40 @@ int vptree_add_many_progress(
   vptree *vp, int n, const void * const *p,
   void *user_data, void (*callback)(void *user_data, int i, int n));
 
+/**
+ * Remove a point from the vp-tree.
+ *
+ * The point is identified by its pointer, as passed to vptree_add.  A
+ * removed vantage point stays in the tree as a tombstone to route searches,
+ * but is no longer returned by any query.  See vptree_options.compact_ratio.
+ *
+ * @returns 0 on success, nonzero if @c p is not in the tree or on failure
+ */
+int vptree_remove(vptree *vp, const void *p);
+
+/**
+ * Rebuild every subtree in which removed points make up more than
+ * @c ratio of the points, dropping the tombstones.  A ratio of 0 removes
+ * all tombstones.
+ *
+ * @note Frozen trees cannot be compacted.
+ * @returns 0 on success, nonzero on failure
+ */
+int vptree_compact(vptree *vp, double ratio);
+
+/**
+ * Compact a finished vp-tree into a single contiguous block of memory.
+ *
+ * Nodes are laid out in van Emde Boas order, so that each subtree touched by
+ * a query occupies few cache lines.  Queries work unchanged on the frozen
+ * tree.
+ *
+ * @note The tree becomes immutable: further vptree_add and vptree_add_many
+ *       calls fail.  A vptree_clone of a frozen tree is not frozen.
+ * @returns 0 on success, nonzero on failure
+ */
+int vptree_freeze(vptree *vp);
+
 /**
  * Find k nearest neighbors.
  *
@@ -100,11 +234,44 @@ void vptree_nearest_neighbor(
   const vptree *vp, const void *p,
 	int k, const void **nn);
 
+/**
+ * Find k nearest neighbors, and their distances from @c p.
+ *
+ * @see vptree_nearest_neighbor
+ * @arg @c dist Output argument, must have space for @c k doubles.  Slots
+ *      without a neighbor are set to INFINITY.
+ */
+void vptree_nearest_neighbor_dist(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist);
+
+/**
+ * Find k approximate nearest neighbors, within a factor of 1 + @c eps.
+ *
+ * Subtrees are skipped unless they could hold a point closer than the
+ * current k-th distance divided by 1 + @c eps, so the i-th neighbor
+ * returned is at most 1 + @c eps times as far as the true i-th nearest
+ * neighbor.  Returns neighbors sorted by distance in ascending order.
+ *
+ * @see vptree_nearest_neighbor_dist
+ * @arg @c dist Output argument, must have space for @c k doubles, or NULL
+ *      if not wanted
+ * @returns 1 if the neighbors are known to be exact, 0 if they may not be,
+ *          -1 on failure
+ */
+int vptree_nearest_neighbor_eps(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist, double eps);
+
 /**
  * Find k nearest neighbors of multiple points.
  *
+ * Queries are shared between vptree_options.num_threads threads, each with
+ * its own scratch space.  Unused neighbor slots are set to NULL.
+ *
  * @see vptree_nearest_neighbor
- * @arg @c nn Output argument, each k points is for one n
+ * @arg @c nn Output argument, each k points is for one n: the neighbors of
+ *      @c p[i] are written to @c nn[i*k] to @c nn[i*k + k-1]
  */
 void vptree_nearest_neighbor_many(
   const vptree *vp, int n, const void * const *p,
@@ -119,22 +286,114 @@ void vptree_nearest_neighbor_many(
 const void **vptree_neighborhood(
   const vptree *vp, const void *p, double distance, int *n);
 
+/**
+ * Find all neighbors within a given ball of radius @c distance around p,
+ * and their distances from @c p.
+ *
+ * @note Caller must @c free returned pointer and @c *dist.
+ * @arg @c n Output argument of the number of points in the neighborhood
+ * @arg @c dist Output argument of an array of @c n distances
+ */
+const void **vptree_neighborhood_dist(
+  const vptree *vp, const void *p, double distance, int *n,
+  double **dist);
+
 
+/**
+ * Called with each point found by vptree_neighborhood_visit, and its
+ * distance from the query.
+ *
+ * @returns Nonzero to stop the search
+ */
+typedef int (*vptree_neighbor_visitor)(void *user_data, const void *p, double d);
+
+/**
+ * Call @c visit for each point within a given ball of radius @c distance
+ * around p, in no particular order, until it returns nonzero.  Allocates
+ * nothing.
+ *
+ * @returns Nonzero if @c visit stopped the search
+ */
+int vptree_neighborhood_visit(
+  const vptree *vp, const void *p, double distance,
+  void *user_data, vptree_neighbor_visitor visit);
+
+/**
+ * Find all neighbors within a given ball of radius @c distance around p,
+ * into caller-provided buffers.
+ *
+ * The buffers are grown through vptree_options.reallocate, doubling in
+ * size, when they run out of room.  Passing the same buffers to later
+ * queries avoids allocating once they are large enough.  Start with NULL
+ * buffers and a capacity of 0.
+ *
+ * @arg @c nbr In/out argument, buffer for the points found
+ * @arg @c dist In/out argument, buffer for their distances from @c p, with
+ *      the same capacity as @c *nbr, or NULL if not wanted
+ * @arg @c capacity In/out argument, number of entries the buffers hold
+ * @returns The number of points found, or -1 on failure
+ */
+int vptree_neighborhood_buffer(
+  const vptree *vp, const void *p, double distance,
+  const void ***nbr, double **dist, int *capacity);
+
+/**
+ * Count the points within a given ball of radius @c distance around p.
+ *
+ * Subtrees that lie entirely inside the ball, by their covering radius, are
+ * counted whole without visiting their points.
+ */
+int vptree_range_count(const vptree *vp, const void *p, double distance);
 
 typedef struct vptree_incnn vptree_incnn;
 
 /**
- * Begin an incremental k-nearest neighbor search
+ * Begin an incremental k-nearest neighbor search.
+ *
+ * Neighbors are found best-first from a single priority queue of subtrees
+ * and points, so fetching the next one costs amortized O(log n) queue
+ * operations, and the first m cost about as much as an m-NN query.
+ *
+ * @returns The search, or NULL if memory could not be allocated
  */
 vptree_incnn *vptree_incnn_begin(const vptree *vp, const void *p);
 
 /**
  * Get the next furthest neighbor of the point
  *
- * @note Will return NULL if all points have been exhausted
+ * @note Will return NULL if all points have been exhausted, or if the
+ *       search runs out of memory
  */
 const void *vptree_incnn_next(vptree_incnn *inc);
 
+/**
+ * Get the next furthest neighbor of the point, and its distance
+ *
+ * @arg @c dist Output argument of the distance to the neighbor, untouched
+ *      if there is none
+ */
+const void *vptree_incnn_next_dist(vptree_incnn *inc, double *dist);
+
+/**
+ * Get up to @c m more neighbors of the point, and their distances, in
+ * order of increasing distance.
+ *
+ * @arg @c nn Output argument, must have space for @c m void pointers
+ * @arg @c dist Output argument, must have space for @c m doubles, or NULL
+ *      if not wanted
+ * @returns The number of neighbors found, fewer than @c m once the points
+ *          are exhausted
+ */
+int vptree_incnn_next_many(vptree_incnn *inc, int m, const void **nn, double *dist);
+
+/**
+ * End the search before the first neighbor at distance @c max_dist or
+ * more, as for vptree_neighborhood.  The threshold can only be lowered;
+ * subtrees beyond it are no longer queued, and distances past it may be
+ * cut short with the distance_bounded option.
+ */
+void vptree_incnn_set_max_distance(vptree_incnn *inc, double max_dist);
+
 /**
  * Terminate an incremental k-nearest neighbor search
  */
@@ -143,7 +402,8 @@ void vptree_incnn_end(vptree_incnn *inc);
 /**
  * Approximate search for k nearest neighbors.
  *
- * Returns neighbors sorted by distance in ascending order.
+ * Returns neighbors sorted by distance in ascending order.  Nodes are
+ * visited best-bin-first, nearest lower bound on their subtree first.
  *
  * @arg @c max_nodes The maximum number of nodes to visit
  * @arg @c nn Output argument, must have space for @c k void pointers
@@ -152,6 +412,85 @@ void vptree_nearest_neighbor_approx(
   const vptree *vp, const void *p,
 	int k, const void **nn, int max_nodes);
 
+/**
+ * Approximate search for k nearest neighbors, and their distances from
+ * @c p.
+ *
+ * @see vptree_nearest_neighbor_approx
+ * @arg @c dist Output argument, must have space for @c k doubles
+ */
+void vptree_nearest_neighbor_approx_dist(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist, int max_nodes);
+
+
+
+typedef struct vptree_query_ctx vptree_query_ctx;
+
+/**
+ * Create scratch space for queries on @c vp.
+ *
+ * Queries through a context reuse its buffers, which grow to fit the largest
+ * @c k and @c max_nodes seen, so repeated queries allocate nothing once warm.
+ *
+ * @note A context may only be used by one thread at a time, and must be
+ *       destroyed before the tree.
+ * @returns The new context, or NULL on failure
+ */
+vptree_query_ctx *vptree_query_ctx_create(const vptree *vp);
+
+/**
+ * Destroy a query context
+ */
+void vptree_query_ctx_destroy(vptree_query_ctx *ctx);
+
+/**
+ * Find k nearest neighbors, using the scratch space of @c ctx.
+ *
+ * @see vptree_nearest_neighbor
+ */
+void vptree_nearest_neighbor_ctx(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn);
+
+/**
+ * Approximate search for k nearest neighbors, using the scratch space of
+ * @c ctx.
+ *
+ * @see vptree_nearest_neighbor_approx
+ */
+void vptree_nearest_neighbor_approx_ctx(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn, int max_nodes);
+
+/**
+ * Find k nearest neighbors, giving up after @c budget_ns nanoseconds.
+ *
+ * The search reads a monotonic clock every few nodes.  If it runs out of
+ * time, the best neighbors found so far are returned, sorted by distance
+ * in ascending order; slots without one are NULL.  A budget of LLONG_MAX
+ * is no limit.
+ *
+ * @see vptree_nearest_neighbor_dist
+ * @arg @c dist Output argument, must have space for @c k doubles, or NULL
+ *      if not wanted
+ * @returns 1 if the search finished and the neighbors are exact, 0 if it
+ *          was stopped by the deadline, -1 on failure
+ */
+int vptree_nearest_neighbor_deadline(
+  const vptree *vp, const void *p,
+  int k, const void **nn, double *dist, long long budget_ns);
+
+/**
+ * Find k nearest neighbors within a time budget, using the scratch space
+ * of @c ctx.
+ *
+ * @see vptree_nearest_neighbor_deadline
+ */
+int vptree_nearest_neighbor_deadline_ctx(
+  vptree_query_ctx *ctx, const void *p,
+  int k, const void **nn, double *dist, long long budget_ns);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,6 +2,8 @@
 #define __VPTREE_HH__
 
 #include <vector>
+#include <limits>
+#include <new>
 
 #include "vptree.h"
 
@@ -41,10 +43,14 @@ class IncrementalKNN
   friend class VPTree<Point>;
 
 protected:
-  IncrementalKNN(const vptree *vp, const Point &query) :
-    query(query)
+  IncrementalKNN(const vptree *vp, const Point &query, double maxDistance) :
+    pos(0), count(0), query(query)
   {
     inc_ = vptree_incnn_begin(vp, &this->query);
+    if(inc_ == NULL) {
+      throw std::bad_alloc();
+    }
+    vptree_incnn_set_max_distance(inc_, maxDistance);
     next();
   }
 
@@ -56,7 +62,17 @@ public:
 
   void next()
   {
-    p = reinterpret_cast<Point *>(vptree_incnn_next(inc_));
+    if(pos == count) {
+      fetch();
+    }
+    if(pos < count) {
+      p = reinterpret_cast<const Point *>(buffer[pos]);
+      d = bufferDistances[pos];
+      pos++;
+    }
+    else {
+      p = NULL;
+    }
   }
 
   const Point *get()
@@ -64,6 +80,14 @@ public:
     return p;
   }
 
+  /**
+   * Distance from the query to the current neighbor
+   */
+  double distance()
+  {
+    return d;
+  }
+
   const IncrementalKNN &operator ++ ()
   {
     next();
@@ -73,8 +97,31 @@ public:
 private:
   vptree_incnn *inc_;
   const Point *p;
+  double d;
+
+  /**
+   * Neighbors fetched ahead from the C search, in batches that double up to
+   * maxBatch
+   */
+  static const size_t maxBatch = 256;
+  std::vector<const void *> buffer;
+  std::vector<double> bufferDistances;
+  size_t pos, count;
+
   const Point query;
 
+  void fetch()
+  {
+    size_t m = buffer.empty() ? 8 : 2 * buffer.size();
+    if(m > maxBatch) {
+      m = maxBatch;
+    }
+    buffer.resize(m);
+    bufferDistances.resize(m);
+    count = vptree_incnn_next_many(inc_, (int)m, buffer.data(), bufferDistances.data());
+    pos = 0;
+  }
+
   IncrementalKNN(const IncrementalKNN &) = delete;
   IncrementalKNN &operator=(const IncrementalKNN &) = delete;
 };
@@ -124,6 +171,28 @@ public:
     return return_nns;
   }
 
+  /**
+   * As nearestNeighbors, also filling @c distances with the distance to
+   * each neighbor
+   */
+  std::vector<const Point *> nearestNeighbors(const Point &query, int k,
+                                              std::vector<double> &distances)
+  {
+    update();
+    if(k > vptree_npoints(vp)) {
+      k = vptree_npoints(vp);
+    }
+
+    const void **nn_ptrs = new const void *[k];
+    distances.resize(k);
+    vptree_nearest_neighbor_dist(vp, &query, k, nn_ptrs, distances.data());
+
+    std::vector<const Point *> return_nns = castPointers(k, nn_ptrs);
+
+    delete [] nn_ptrs;
+    return return_nns;
+  }
+
   std::vector<const Point *> approxNearestNeighbors(const Point &query, int k = 1, int max_nodes = 1024)
   {
     update();
@@ -140,6 +209,28 @@ public:
     return return_nns;
   }
 
+  /**
+   * As approxNearestNeighbors, also filling @c distances with the distance
+   * to each neighbor
+   */
+  std::vector<const Point *> approxNearestNeighbors(const Point &query, int k, int max_nodes,
+                                                    std::vector<double> &distances)
+  {
+    update();
+    if(k > vptree_npoints(vp)) {
+      k = vptree_npoints(vp);
+    }
+
+    const void **nn_ptrs = new const void *[k];
+    distances.resize(k);
+    vptree_nearest_neighbor_approx_dist(vp, &query, k, nn_ptrs, distances.data(), max_nodes);
+
+    std::vector<const Point *> return_nns = castPointers(k, nn_ptrs);
+
+    delete [] nn_ptrs;
+    return return_nns;
+  }
+
   std::vector<const Point *> neighborhood(const Point &query, double distance)
   {
     update();
@@ -151,11 +242,36 @@ public:
     return return_nns;
   }
 
-  IncrementalKNN<Point> incrementalNearestNeighbor(const Point &query)
+  /**
+   * As neighborhood, also filling @c distances with the distance to each
+   * neighbor
+   */
+  std::vector<const Point *> neighborhood(const Point &query, double distance,
+                                          std::vector<double> &distances)
+  {
+    update();
+
+    int k = 0;
+    double *dist = NULL;
+    const void **ptrs = vptree_neighborhood_dist(vp, &query, distance, &k, &dist);
+    std::vector<const Point *> return_nns = castPointers(k, ptrs);
+    distances.assign(dist, dist + k);
+    free(ptrs);
+    free(dist);
+    return return_nns;
+  }
+
+  /**
+   * Neighbors of @c query in order of increasing distance, ending before
+   * the first at @c maxDistance or more
+   */
+  IncrementalKNN<Point> incrementalNearestNeighbor(
+    const Point &query,
+    double maxDistance = std::numeric_limits<double>::infinity())
   {
     update();
 
-    return IncrementalKNN<Point>(vp, query);
+    return IncrementalKNN<Point>(vp, query, maxDistance);
   }
 
 protected:
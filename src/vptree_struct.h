@@ -4,8 +4,33 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "arena.h"
+
 typedef struct node node;
 
+/**
+ * A point and its distance to some reference point
+ */
+typedef struct distp {
+  double d;
+  const void *p;
+
+  /**
+   * While building, the point's distances to the vantage points it has
+   * passed, indexed by depth modulo opts.pivot_history.  NULL if the tree
+   * keeps no pivot history.
+   */
+  double *hist;
+} distp;
+
+/**
+ * A point in a leaf bucket and its distance to the leaf's vantage point
+ */
+typedef struct bucketp {
+  double d;
+  const void *p;
+} bucketp;
+
 struct vptree
 {
   vptree_options opts;
@@ -16,21 +41,80 @@ struct vptree
    * The number of points currently in the vp-tree
    */
   int n;
+
+  /**
+   * Random number generator state, seeds each vptree_add_many call
+   */
+  uint64_t rng;
+
+  /**
+   * Single block holding all nodes and buckets after vptree_freeze, or NULL
+   * if the nodes are allocated individually
+   */
+  void *frozen;
+
+  /**
+   * Storage for nodes and leaf buckets, if opts.slab_size is nonzero
+   */
+  arena_t arena;
+  arena_pool_t node_pool, bucket_pool, bucket_anc_pool;
 };
 
+/**
+ * The points of a leaf node other than its vantage point.  Only split
+ * nodes have bounds, so a leaf stores this in their place; it is no larger
+ * than the 2 * opts.arity doubles.
+ */
+typedef struct leaf {
+  /**
+   * The points, with their distances to the leaf's vantage point
+   */
+  int nbucket;
+  bucketp *bucket;
+
+  /**
+   * Pivot history of each point, as for node_anc, one row of
+   * opts.pivot_history distances per point.  NULL without pivot history.
+   */
+  double *anc;
+} leaf;
+
 struct node
 {
-  vptree *vp;
-
   /**
    * Vantage point
    */
   const void *p;
 
   /**
-   * Split distance.
+   * Number of points in the subtree rooted at this node, including removed
+   * points that are still present as tombstones
    */
-  double mu;
+  int size;
+
+  /**
+   * Number of tombstones in the subtree rooted at this node
+   */
+  int ndeleted;
+
+  /**
+   * The vantage point has been removed, and only routes searches
+   */
+  bool deleted;
+
+  /**
+   * The subtree is not rebuilt to rebalance it before it holds this many
+   * points: half again as many as when it was last built.  Every rebuild is
+   * then paid for by insertions in proportion to its size, even when ties
+   * leave the rebuilt subtree no better balanced.
+   */
+  int rebuild_size;
+
+  /**
+   * Covering radius: no point in the subtree rooted at this node is further
+   * than this from @c p.  Not reduced when points are removed.
+   */
+  double radius;
 
   /**
    * Parent node
@@ -38,25 +122,45 @@ struct node
   node *parent;
 
   /**
-   * Subnode for points at distance < mu
+   * Split distances, opts.arity - 1 of them in ascending order.  Child i
+   * holds the points at distance in [mu[i-1], mu[i]) from @c p, the first
+   * shell starting at 0 and the last unbounded.  mu[0] < 0 for a leaf node.
+   *
+   * The rest of the node's allocation follows mu, laid out from opts (see
+   * node_bound, node_child, node_anc and node_leaf):
+   *  - bound: smallest and largest distance from @c p to any point added
+   *    below each child, as bound[2*i] and bound[2*i + 1].  Usually well
+   *    inside the shell.  Not narrowed when points are removed.  A leaf
+   *    keeps its leaf struct here instead.
+   *  - child: opts.arity subnodes, one per shell, all NULL for a leaf.
+   *  - anc: pivot history, if opts.pivot_history is nonzero: distances from
+   *    @c p to the vantage points of its ancestors, parent first, or -1
+   *    above the root.
    */
-  node *lt;
+  double mu[];
+};
 
+/**
+ * A subtree or point waiting in the incremental search's queue
+ */
+typedef struct incentry {
   /**
-   * Subnode for points at distance >= mu
+   * Lower bound on the distance from the query to any point in the
+   * subtree, or the distance to the point
    */
-  node *ge;
-};
+  double key;
 
-typedef struct incnode incnode;
-struct incnode
-{
-  node *n;
-  double d;
-  bool exclude, exclude_tree;
+  /**
+   * The subtree, or NULL for the point @c p
+   */
+  node *nd;
+  const void *p;
 
-  incnode *parent, *lt, *ge;
-};
+  /**
+   * The point's distance is not computed yet, and @c key only bounds it
+   */
+  bool pending;
+} incentry;
 
 struct vptree_incnn
 {
@@ -71,14 +175,68 @@ struct vptree_incnn
   const void *q;
 
   /**
-   * Tree for marking nodes and caching distances between runs
+   * Binary min-heap on key of the subtrees not yet expanded and the points
+   * not yet returned
    */
-  incnode *marks;
+  incentry *heap;
+  int size, capacity;
 
   /**
-   * Previous best point
+   * Points at this distance or further are not returned, nor queued
    */
-  incnode *prev;
+  double max_dist;
+};
+
+/**
+ * A subtree waiting to be searched by the exact k-NN search
+ */
+typedef struct nnentry {
+  node *nd;
+
+  /**
+   * Lower bound on the distance from the query to any point in the subtree
+   */
+  double lb;
+
+  int depth;
+} nnentry;
+
+/**
+ * A node in the approximate search's priority queue
+ */
+typedef struct pqnode {
+  node *nd;
+
+  size_t pos;
+  double prio;
+} pqnode;
+
+struct vptree_query_ctx
+{
+  /**
+   * The vp-tree, whose allocator provides the scratch space
+   */
+  const vptree *vp;
+
+  /**
+   * Distances to the neighbors found so far, room for @c nndist_size
+   */
+  double *nndist;
+  int nndist_size;
+
+  /**
+   * The exact search's stack of pending subtrees, once it outgrows the C
+   * stack, or NULL
+   */
+  nnentry *stack;
+  int stack_size;
+
+  /**
+   * The approximate search's queue entries and priority queue
+   */
+  pqnode *pnodes;
+  int pnodes_size;
+  struct pqueue_t *pq;
 };
 
 /////////////////////////////// Utility Functions /////////////////////////
@@ -103,4 +261,38 @@ static double distance(const vptree *vp, const void *p1, const void *p2)
   return vp->opts.distance(vp->opts.user_data, p1, p2);
 }
 
+/**
+ * Most points passed to one call of the distance_many closure
+ */
+#define DISTANCE_BATCH (64)
+
+/**
+ * Distances from @c q to each of the @c n points @c p
+ */
+static void distance_many(const vptree *vp, const void *q, int n,
+                          const void * const *p, double *d)
+{
+  int i;
+
+  if(vp->opts.distance_many != NULL) {
+    vp->opts.distance_many(vp->opts.user_data, q, n, p, d);
+    return;
+  }
+  for(i = 0; i < n; i++) {
+    d[i] = distance(vp, q, p[i]);
+  }
+}
+
+/**
+ * Distance, exact only if it is at most @c bound
+ */
+static double distance_bounded(const vptree *vp, const void *p1, const void *p2,
+                               double bound)
+{
+  if(vp->opts.distance_bounded == NULL) {
+    return distance(vp, p1, p2);
+  }
+  return vp->opts.distance_bounded(vp->opts.user_data, p1, p2, bound);
+}
+
 #endif // #ifndef __VPTREE_STRUCT_H__